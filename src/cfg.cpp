@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unordered_set>
+
+#include "elf_types.hpp"
+
+#include "decode.h"
+#include "tcache.h"
+#include "loader.h"
+#include "cfg.h"
+
+std::vector<uint32_t> elf_code_roots(const std::string & file)
+{
+    std::vector<uint32_t> roots;
+
+    std::vector<ElfSymbol> symbols = elf_symbols(file);
+    for(size_t i=0; i<symbols.size(); i++)
+    {
+        if(symbols[i].type == STT_FUNC && symbols[i].shndx != SHN_UNDEF)
+            roots.push_back(symbols[i].value);
+    }
+    return roots;
+}
+
+
+// Instruction word at pc, false if pc is not executable
+static bool cfg_fetch(MemMap & mem_map, uint32_t pc, uint32_t & insn)
+{
+    // plain read: pages are marked as code when the blocks are translated
+    uint8_t * p = mem_map.translate(pc, 4, MEM_PERM_X);
+    if(!p)
+        return false;
+    memcpy(&insn, p, 4);
+    return true;
+}
+
+
+static inline bool cfg_is_link(uint8_t r)
+{
+    return r == 1 || r == 5;
+}
+
+
+std::vector<CfgBlock> cfg_discover(MemMap & mem_map, const RVIsa * isa, const std::vector<uint32_t> & roots)
+{
+    std::vector<CfgBlock> blocks;
+    std::unordered_set<uint32_t> seen;
+    std::vector<uint32_t> work(roots.rbegin(), roots.rend());
+
+    while(!work.empty())
+    {
+        uint32_t start = work.back();
+        work.pop_back();
+        if((start & 0x3) || !seen.insert(start).second)
+            continue;
+
+        // same boundaries as RVCore::_translate
+        uint64_t page_end = ((uint64_t)start | (DecodeCache::PAGE_SIZE-1)) + 1;
+        uint32_t pc = start;
+        uint32_t len = 0;
+        DecodedInsn prev, d;
+        prev.op = OP_UNDECODED;
+        prev.rd = RV_REG_SINK;
+        prev.imm = 0;
+        uint32_t insn;
+
+        while(cfg_fetch(mem_map, pc, insn))
+        {
+            isa->decode(insn, d);
+            len++;
+
+            if(op_ends_block(d.op))
+            {
+                switch(d.op)
+                {
+                    case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+                        work.push_back(pc + 4);
+                        work.push_back(pc + d.imm);
+                        break;
+                    case OP_JAL:
+                        if(cfg_is_link(d.rd))
+                            work.push_back(pc + 4);
+                        work.push_back(pc + d.imm);
+                        break;
+                    case OP_JALR:
+                        if(cfg_is_link(d.rd))
+                            work.push_back(pc + 4);
+                        // auipc+jalr far call / tail call has a static target
+                        if(prev.op == OP_AUIPC && prev.rd == d.rs1 && prev.rd != RV_REG_SINK)
+                            work.push_back((pc - 4 + prev.imm + d.imm) & ~1u);
+                        break;
+                    case OP_FENCE_I:
+                        work.push_back(pc + 4);
+                        break;
+                    default:
+                        // ecall/ebreak stop the hart, mret returns to a
+                        // trapping instruction, illegal words are data
+                        break;
+                }
+                break;
+            }
+
+            pc += 4;
+            if(len == BlockCache::MAX_BLOCK_LEN || pc == page_end)
+            {
+                work.push_back(pc);
+                break;
+            }
+            prev = d;
+        }
+
+        // blocks starting with an illegal word are not code
+        if(len && !(len == 1 && d.op == OP_ILLEGAL))
+        {
+            CfgBlock b;
+            b.pc = start;
+            b.len = len;
+            blocks.push_back(b);
+        }
+    }
+    return blocks;
+}
@@ -1,25 +1,66 @@
 #include <vector>
 #include <iostream>
 #include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <atomic>
 
 #include "rvdefs.h"
 #include "core.h"
-#include "memory.h"
+#include "rvexec.h"
+#include "memsim.h"
 
 extern SimArgs * cli_args;
 
-RVCore::RVCore(uint32_t id, std::vector<Memory> * sim_mem, uint32_t reset_addr) :
-    id(id),
+RVCore::RVCore(uint32_t id, MemMap * mem_map, uint32_t reset_addr, const RVIsa * isa) :
+    isa(isa),
+    mem_map(mem_map),
     pc(reset_addr),
+    halted(false),
+    id(id),
     reset_addr(reset_addr),
-    sim_mem(sim_mem),
-    halted(false)
-{}
+    dcache(mem_map)
+{
+    // hot state layout (see core.h); GCC supports offsetof on RVCore (no
+    // virtual bases) but warns since the type is not standard layout
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+    static_assert(offsetof(RVCore, reg_file) + sizeof(reg_file) <= 3*RVSIM_CACHE_LINE, "hot state spans more than three cache lines");
+    static_assert(offsetof(RVCore, id) == 3*RVSIM_CACHE_LINE, "cold state does not start on the line after the hot state");
+#pragma GCC diagnostic pop
+}
+
+
+const RVIsa * RVCore::isa_variant(uint32_t ext)
+{
+    static const RVIsa variants[] =
+    {
+        #define RV_ISA_ENTRY(name, e) {#name, e, &decode<e>, &RVCore::_run_threaded<e>, &RVCore::_exec_block<e>},
+        RV_ISA_VARIANTS(RV_ISA_ENTRY)
+        #undef RV_ISA_ENTRY
+    };
+
+    for(size_t i=0; i<sizeof(variants)/sizeof(variants[0]); i++)
+    {
+        if(variants[i].ext == ext)
+            return &variants[i];
+    }
+    return nullptr;
+}
 
 void RVCore::reset()
 {
     reg_file.clear();
     pc = reset_addr;
+    res_valid = false;
+    trapped = false;
+    trap_handler = false;
+    mstatus = mtvec = mscratch = mepc = mcause = mtval = 0;
+    instret = 0;
+    traps = 0;
+    dcache.flush();
+    _flush_translations();
 };
 
 
@@ -35,6 +76,28 @@ void RVCore::tick()
 
 void RVCore::run()
 {
+    if(cli_args->engine == "threaded")
+    {
+        run_threaded();
+        return;
+    }
+    if(cli_args->engine == "block" || cli_args->engine == "jit" || cli_args->engine == "tiered")
+    {
+        // block & jit translate everything on first use
+        if(cli_args->engine != "tiered")
+        {
+            tiers.threaded_threshold = 0;
+        }
+        jit_enabled = (cli_args->engine != "block") && tiers.native_threshold;
+        if(jit_enabled && !RVJit::available())
+        {
+            throwWarning("JIT: native translation not supported on this host, using translated blocks only");
+            jit_enabled = false;
+        }
+        run_blocks();
+        return;
+    }
+
     while(!halted)
     {
         tick();
@@ -43,56 +106,519 @@ void RVCore::run()
 
 void RVCore::_fetch()
 {
-    if(!halted)
+    if(halted)
+    {
+        cur = nullptr;
+        ir = RV_INSTR_NOP;
+        return;
+    }
+
+    if(UNLIKELY(pc & 0x3))
+    {
+        // misaligned reset address or entry point; jumps to misaligned
+        // targets trap before they get here
+        _trap(RV_EXC_INSN_MISALIGNED, pc);
+    }
+    else
     {
-        bool fetch_success = false;
-        for(std::vector<Memory>::iterator it = (*sim_mem).begin(); it!=(*sim_mem).end(); it++)
+        // Look in predecode cache first, raw word is only needed on a miss
+        cur = dcache.lookup(pc);
+        if(cur->op != OP_UNDECODED)
         {
-            if(it->isValidAddress(pc))
-            {
-                ir = it->fetchWord(pc);
-                fetch_success = true;
-                LOG_DUMP("core[" + std::to_string(id) + "] fetch [" + std::to_string(pc) + "]:" + std::to_string(ir));
-                pc+=4;
-            }
+            return;
         }
 
-        if(!fetch_success)
+        ir = _fetch_word(pc);
+    }
+
+    if(UNLIKELY(trapped))
+    {
+        // fetch trapped: pc is at the trap handler now, nothing to execute
+        trapped = false;
+        cur = nullptr;
+        if(instret + traps >= cli_args->maxitr)
+            halted = true;
+    }
+}
+
+
+void RVCore::_decode()
+{
+    if(cur && cur->op == OP_UNDECODED)
+    {
+        isa->decode(ir, *cur);
+    }
+}
+
+
+void RVCore::_execute()
+{
+    if(!cur)
+        return;
+
+    LOG_DUMP("core[" + std::to_string(id) + "] exec [" + std::to_string(pc) + "]: " + op_name(cur->op));
+    cur->exec(*this, *cur);
+    if(UNLIKELY(trapped))
+    {
+        // trapping instructions do not retire
+        trapped = false;
+        if(instret + traps >= cli_args->maxitr)
+            halted = true;
+        return;
+    }
+
+    if(++instret + traps >= cli_args->maxitr)
+    {
+        halted = true;
+    }
+}
+
+
+void RVCore::_mem_access()
+{
+    // memory access is done by the instruction handlers
+}
+
+
+void RVCore::_writeback()
+{
+    // register writeback is done by the instruction handlers
+}
+
+
+// =============================== MEMORY ACCESS =====================================
+uint32_t RVCore::_fetch_word(uint32_t addr)
+{
+    uint8_t * p = mem_map->translate(addr, 4, MEM_PERM_X);
+    if(UNLIKELY(!p))
+    {
+        _mem_fault(addr, 4, MEM_PERM_X);
+        return RV_INSTR_NOP;
+    }
+
+    // only called to decode, so stores to the page must be watched from now on
+    mem_map->mark_code(addr);
+
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return w;
+}
+
+
+uint32_t RVCore::_load(uint32_t addr, uint32_t len)
+{
+    uint8_t * p = mem_map->translate(addr, len, MEM_PERM_R);
+    if(UNLIKELY(!p))
+    {
+        _mem_fault(addr, len, MEM_PERM_R);
+        return 0;
+    }
+
+    // aligned accesses are single-copy atomic; misaligned ones need not be
+    if(LIKELY(!((uintptr_t)p & (len-1))))
+    {
+        switch(len)
         {
-            throwError("Core["+std::to_string(id)+"]: Tried to fetch from an address out of mem bounds [PC:"+std::to_string(pc)+"]", true);
+            case 1: return mem_load_atomic<uint8_t>(p);
+            case 2: return mem_load_atomic<uint16_t>(p);
+            default: return mem_load_atomic<uint32_t>(p);
         }
     }
+    if(len == 2)
+    {
+        uint16_t hw;
+        memcpy(&hw, p, 2);
+        return hw;
+    }
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return w;
+}
+
+
+void RVCore::_store(uint32_t addr, uint32_t len, uint32_t value)
+{
+    // the page entry is kept to mark the page dirty after the store
+    const MemMap::Entry * e = mem_map->lookup_entry(addr, len, MEM_PERM_W);
+    uint8_t * p;
+    if(LIKELY(e != nullptr))
+    {
+        p = e->host + (addr & MemMap::PAGE_MASK);
+    }
     else
     {
-        ir = RV_INSTR_NOP;
+        // page crossing, partly mapped, not writable or holding code
+        p = mem_map->translate(addr, len, MEM_PERM_W);
+        if(!p)
+        {
+            _mem_fault(addr, len, MEM_PERM_W);
+            return;
+        }
+        if(mem_map->code_written(addr, len))
+        {
+            _code_written(addr, len);
+        }
     }
 
+    if(LIKELY(!((uintptr_t)p & (len-1))))
+    {
+        switch(len)
+        {
+            case 1: mem_store_atomic<uint8_t>(p, (uint8_t)value); break;
+            case 2: mem_store_atomic<uint16_t>(p, (uint16_t)value); break;
+            default: mem_store_atomic<uint32_t>(p, value); break;
+        }
+    }
+    else
+    {
+        memcpy(p, &value, len);
+    }
+
+    if(LIKELY(e != nullptr))
+        MemMap::mark_dirty(*e, addr);
+    else
+        mem_map->mark_dirty(addr, len);
+
+    // stores break the lr/sc reservations of other harts on the line
+    mem_map->reservations.invalidate(addr, len);
 }
 
 
-void RVCore::_decode()
+uint32_t * RVCore::_amo_ptr(uint32_t addr, uint32_t perm)
 {
+    if(UNLIKELY(addr & 0x3))
+    {
+        _trap((perm & MEM_PERM_W) ? RV_EXC_STORE_MISALIGNED : RV_EXC_LOAD_MISALIGNED, addr);
+        return nullptr;
+    }
+
+    uint8_t * p = mem_map->lookup(addr, 4, perm);
+    if(UNLIKELY(!p))
+    {
+        p = mem_map->translate(addr, 4, perm);
+        if(!p)
+        {
+            _mem_fault(addr, 4, (perm & MEM_PERM_W) ? MEM_PERM_W : MEM_PERM_R);
+            return nullptr;
+        }
+        if((perm & MEM_PERM_W) && mem_map->code_written(addr, 4))
+        {
+            _code_written(addr, 4);
+        }
+    }
 
+    // atomic_ref needs a naturally aligned host word too; regions are 4-byte
+    // aligned in guest and host memory (see MemMap::MemMap())
+    return (uint32_t *)p;
 }
 
 
-void RVCore::_execute()
+void RVCore::_code_written(uint32_t addr, uint32_t len)
+{
+    // decode slots are reset in place, so the executing one stays valid;
+    // blocks can only be dropped between blocks
+    dcache.invalidate(addr);
+    dcache.invalidate(addr+len-1);
+    code_stale = true;
+}
+
+
+void RVCore::_mem_fault(uint32_t addr, uint32_t len, uint32_t perm)
 {
+    if(LIKELY(trap_handler))
+    {
+        _trap((perm == MEM_PERM_X) ? RV_EXC_INSN_ACCESS : (perm == MEM_PERM_W) ? RV_EXC_STORE_ACCESS : RV_EXC_LOAD_ACCESS, addr);
+        return;
+    }
 
+    // no trap handler: report the fault itself
+    const char * access = (perm == MEM_PERM_X) ? "fetch" : (perm == MEM_PERM_W) ? "store" : "load";
+    char errmsg[120];
+    if(!mem_map->region(addr, len))
+        sprintf(errmsg, "Core[%u]: %s out of mem bounds [PC:0x%08x, addr:0x%08x]", id, access, pc, addr);
+    else
+        sprintf(errmsg, "Core[%u]: %s not permitted by memory region [PC:0x%08x, addr:0x%08x]", id, access, pc, addr);
+    throwError(errmsg, true);
 }
 
 
-void RVCore::_mem_access()
+// =============================== SYSTEM INSTRUCTIONS =====================================
+void RVExec::UNDECODED(RVCore & c, const DecodedInsn & d)
+{
+    // Slot has not been decoded yet; decode in place and execute
+    DecodedInsn & slot = const_cast<DecodedInsn &>(d);
+    c.ir = c._fetch_word(c.pc);
+    if(UNLIKELY(c.trapped))
+        return;
+    c.isa->decode(c.ir, slot);
+    slot.exec(c, slot);
+}
+
+
+void RVExec::ILLEGAL(RVCore & c, const DecodedInsn & d)
 {
+    // the decoder keeps the raw word of illegal instructions
+    c._trap(RV_EXC_ILLEGAL_INSN, (uint32_t)d.imm);
+}
 
+
+void RVExec::FENCE_I(RVCore & c, const DecodedInsn & d)
+{
+    c.pc += 4;
+    // only pages written since they were decoded (by any hart) are dropped;
+    // this may reset the record being executed, so nothing may touch d after this
+    c.dcache.sync();
+    // blocks are synced once the executing block has been left
+    c.code_stale = true;
 }
 
 
-void RVCore::_writeback()
+// A extension: guest words are updated with host atomic read-modify-writes,
+// so harts on different host threads never serialize on a lock
+
+void RVExec::LR_W(RVCore & c, const DecodedInsn & d)
+{
+    uint32_t addr = c.reg_file[d.rs1];
+    uint32_t * p = c._amo_ptr(addr, MEM_PERM_R);
+    if(UNLIKELY(!p))
+        return;
+
+    // reserve first: a store after the load then always breaks the reservation
+    c.mem_map->reservations.reserve(c.id, addr);
+    c.res_valid = true;
+    c.res_addr = addr;
+    c.res_value = std::atomic_ref<uint32_t>(*p).load();
+    c.reg_file[d.rd] = c.res_value;
+    c.pc += 4;
+}
+
+
+void RVExec::SC_W(RVCore & c, const DecodedInsn & d)
 {
+    uint32_t addr = c.reg_file[d.rs1];
+    uint32_t value = c.reg_file[d.rs2];
+    uint32_t * p = c._amo_ptr(addr, MEM_PERM_W);
+    if(UNLIKELY(!p))
+        return;
+
+    // an sc always ends the reservation
+    bool ok = c.res_valid && c.mem_map->reservations.release(c.id, c.res_addr) && c.res_addr == addr;
+    c.res_valid = false;
+
+    // the reservation is dropped by stores that happen after the check too:
+    // the word must still hold the value lr loaded
+    if(ok)
+    {
+        uint32_t expected = c.res_value;
+        ok = std::atomic_ref<uint32_t>(*p).compare_exchange_strong(expected, value);
+        if(ok)
+        {
+            c.mem_map->mark_dirty(addr, 4);
+            c.mem_map->reservations.invalidate(addr, 4);
+        }
+    }
+
+    c.reg_file[d.rd] = ok ? 0 : 1;
+    c.pc += 4;
+}
+
+
+// fetch_op for the operations std::atomic_ref has no member for
+template<typename F>
+static inline uint32_t amo_fetch_update(std::atomic_ref<uint32_t> w, F op)
+{
+    uint32_t old = w.load(std::memory_order_relaxed);
+    while(!w.compare_exchange_weak(old, op(old)))
+        ;
+    return old;
+}
 
+#define RV_AMO(name, expr)                                                  \
+void RVExec::name(RVCore & c, const DecodedInsn & d)                        \
+{                                                                           \
+    uint32_t addr = c.reg_file[d.rs1];                                      \
+    uint32_t v = c.reg_file[d.rs2];                                         \
+    uint32_t * p = c._amo_ptr(addr, MEM_PERM_R | MEM_PERM_W);              \
+    if(UNLIKELY(!p))                                                        \
+        return;                                                             \
+    std::atomic_ref<uint32_t> w(*p);                                        \
+    uint32_t old = expr;                                                    \
+    c.mem_map->mark_dirty(addr, 4);                                         \
+    c.mem_map->reservations.invalidate(addr, 4);                            \
+    c.reg_file[d.rd] = old;                                                 \
+    c.pc += 4;                                                              \
 }
 
+RV_AMO(AMOSWAP_W,   w.exchange(v))
+RV_AMO(AMOADD_W,    w.fetch_add(v))
+RV_AMO(AMOXOR_W,    w.fetch_xor(v))
+RV_AMO(AMOAND_W,    w.fetch_and(v))
+RV_AMO(AMOOR_W,     w.fetch_or(v))
+RV_AMO(AMOMIN_W,    amo_fetch_update(w, [v](uint32_t x) { return ((int32_t)x < (int32_t)v) ? x : v; }))
+RV_AMO(AMOMAX_W,    amo_fetch_update(w, [v](uint32_t x) { return ((int32_t)x > (int32_t)v) ? x : v; }))
+RV_AMO(AMOMINU_W,   amo_fetch_update(w, [v](uint32_t x) { return (x < v) ? x : v; }))
+RV_AMO(AMOMAXU_W,   amo_fetch_update(w, [v](uint32_t x) { return (x > v) ? x : v; }))
 
+#undef RV_AMO
 
 
+void RVExec::ECALL(RVCore & c, const DecodedInsn & d)
+{
+    if(c.trap_handler)
+    {
+        c._trap(RV_EXC_ECALL_M, 0);
+        return;
+    }
+
+    // No execution environment to service the call: halt hart
+    LOG_DUMP("core[" + std::to_string(c.id) + "] ecall");
+    c.halted = true;
+    c.pc += 4;
+}
+
+
+void RVExec::EBREAK(RVCore & c, const DecodedInsn & d)
+{
+    if(c.trap_handler)
+    {
+        c._trap(RV_EXC_BREAKPOINT, c.pc);
+        return;
+    }
+
+    // No debugger either: halt hart
+    LOG_DUMP("core[" + std::to_string(c.id) + "] ebreak");
+    c.halted = true;
+    c.pc += 4;
+}
+
+
+void RVExec::MRET(RVCore & c, const DecodedInsn & d)
+{
+    // MIE = MPIE, MPIE = 1; MPP stays M (the only mode)
+    uint32_t mie = (c.mstatus & RV_MSTATUS_MPIE) ? RV_MSTATUS_MIE : 0;
+    c.mstatus = (c.mstatus & ~RV_MSTATUS_MIE) | mie | RV_MSTATUS_MPIE;
+    c.pc = c.mepc;
+}
+
+
+// Zicsr: read the CSR, then write it (W), set (S) or clear (C) the source
+// bits. CSRRS/CSRRC with x0 (or a zero immediate) as source do not write.
+#define RV_CSR_OP(name, funct3, src, update)                                \
+void RVExec::name(RVCore & c, const DecodedInsn & d)                        \
+{                                                                           \
+    uint32_t csr = d.imm & 0xfff;                                           \
+    uint32_t s = src;                                                       \
+    bool write = (funct3 & 0x3) == 0x1 || d.rs1 != 0;                       \
+    uint32_t old;                                                           \
+    if(UNLIKELY(!c._csr_read(csr, old) || (write && !c._csr_write(csr, update)))) \
+    {                                                                       \
+        uint32_t rd = (d.rd == RV_REG_SINK) ? 0 : d.rd;                     \
+        uint32_t insn = (csr << 20) | (d.rs1 << 15) | (funct3 << 12) | (rd << 7) | RV_OPCODE_SYSTEM; \
+        c._trap(RV_EXC_ILLEGAL_INSN, insn);                                 \
+        return;                                                             \
+    }                                                                       \
+    c.reg_file[d.rd] = old;                                                 \
+    c.pc += 4;                                                              \
+}
+
+RV_CSR_OP(CSRRW,    0x1, c.reg_file[d.rs1], s)
+RV_CSR_OP(CSRRS,    0x2, c.reg_file[d.rs1], old | s)
+RV_CSR_OP(CSRRC,    0x3, c.reg_file[d.rs1], old & ~s)
+RV_CSR_OP(CSRRWI,   0x5, d.rs1,             s)
+RV_CSR_OP(CSRRSI,   0x6, d.rs1,             old | s)
+RV_CSR_OP(CSRRCI,   0x7, d.rs1,             old & ~s)
+
+#undef RV_CSR_OP
+
+
+// =============================== TRAPS =====================================
+static const char * trap_name(uint32_t cause)
+{
+    switch(cause)
+    {
+        case RV_EXC_INSN_MISALIGNED:    return "Misaligned instruction address";
+        case RV_EXC_INSN_ACCESS:        return "Instruction access fault";
+        case RV_EXC_ILLEGAL_INSN:       return "Illegal instruction";
+        case RV_EXC_BREAKPOINT:         return "Breakpoint";
+        case RV_EXC_LOAD_MISALIGNED:    return "Misaligned load";
+        case RV_EXC_LOAD_ACCESS:        return "Load access fault";
+        case RV_EXC_STORE_MISALIGNED:   return "Misaligned store/AMO";
+        case RV_EXC_STORE_ACCESS:       return "Store/AMO access fault";
+        case RV_EXC_ECALL_M:            return "Environment call";
+        default:                        return "Exception";
+    }
+}
+
+
+void RVCore::_trap(uint32_t cause, uint32_t tval)
+{
+    // the handler faulting on its first fetch would trap back to itself
+    if(!trap_handler || (cause == RV_EXC_INSN_ACCESS && tval == mtvec))
+    {
+        char errmsg[120];
+        sprintf(errmsg, "Core[%u]: %s%s [PC:0x%08x, tval:0x%08x]", id, trap_name(cause), trap_handler ? " in trap handler" : "", pc, tval);
+        throwError(errmsg, true);
+        return;
+    }
+
+    LOG_DUMP("core[" + std::to_string(id) + "] trap " + std::to_string(cause) + " [" + std::to_string(pc) + "]");
+    mepc = pc;
+    mcause = cause;
+    mtval = tval;
+    mstatus = (mstatus & ~(RV_MSTATUS_MIE | RV_MSTATUS_MPIE)) | ((mstatus & RV_MSTATUS_MIE) ? RV_MSTATUS_MPIE : 0);
+    pc = mtvec;
+    trapped = true;
+    traps++;
+}
+
+
+bool RVCore::_csr_read(uint32_t csr, uint32_t & value)
+{
+    switch(csr)
+    {
+        case RV_CSR_MSTATUS:    value = mstatus | RV_MSTATUS_MPP; break;
+        case RV_CSR_MISA:
+            // MXL = 32 bit, one bit per extension letter
+            value = (1u << 30) | ((isa->ext & RV_EXT_A) ? 1u << 0 : 0) | ((isa->ext & RV_EXT_C) ? 1u << 2 : 0)
+                | ((isa->ext & RV_EXT_D) ? 1u << 3 : 0) | ((isa->ext & RV_EXT_F) ? 1u << 5 : 0)
+                | ((isa->ext & RV_EXT_I) ? 1u << 8 : 0) | ((isa->ext & RV_EXT_M) ? 1u << 12 : 0);
+            break;
+        case RV_CSR_MIE:        value = 0; break;
+        case RV_CSR_MIP:        value = 0; break;
+        case RV_CSR_MTVEC:      value = mtvec; break;
+        case RV_CSR_MSCRATCH:   value = mscratch; break;
+        case RV_CSR_MEPC:       value = mepc; break;
+        case RV_CSR_MCAUSE:     value = mcause; break;
+        case RV_CSR_MTVAL:      value = mtval; break;
+        case RV_CSR_MVENDORID:  value = 0; break;
+        case RV_CSR_MARCHID:    value = 0; break;
+        case RV_CSR_MIMPID:     value = 0; break;
+        case RV_CSR_MHARTID:    value = id; break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+bool RVCore::_csr_write(uint32_t csr, uint32_t value)
+{
+    if(RV_CSR_READ_ONLY(csr))
+        return false;
+
+    switch(csr)
+    {
+        case RV_CSR_MSTATUS:    mstatus = value & (RV_MSTATUS_MIE | RV_MSTATUS_MPIE); break;
+        case RV_CSR_MISA:       break;  // extensions cannot be switched off
+        case RV_CSR_MIE:        break;  // no interrupt sources
+        case RV_CSR_MIP:        break;
+        case RV_CSR_MTVEC:      mtvec = value & ~0x3u; trap_handler = true; break;  // direct mode only
+        case RV_CSR_MSCRATCH:   mscratch = value; break;
+        case RV_CSR_MEPC:       mepc = value & ~0x3u; break;
+        case RV_CSR_MCAUSE:     mcause = value; break;
+        case RV_CSR_MTVAL:      mtval = value; break;
+        default:
+            return false;
+    }
+    return true;
+}
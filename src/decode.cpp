@@ -0,0 +1,255 @@
+#include <stdint.h>
+
+#include "rvdefs.h"
+#include "decode.h"
+#include "rvexec.h"
+#include "memmap.h"
+
+// Handler table indexed by RVOp
+static const ExecFn exec_table[OP_COUNT] =
+{
+    #define RV_OP_HANDLER(name) &RVExec::name,
+    RV_OP_LIST(RV_OP_HANDLER)
+    #undef RV_OP_HANDLER
+};
+
+static const char * op_names[OP_COUNT] =
+{
+    #define RV_OP_NAME(name) #name,
+    RV_OP_LIST(RV_OP_NAME)
+    #undef RV_OP_NAME
+};
+
+
+ExecFn op_handler(uint8_t op)
+{
+    return exec_table[op];
+}
+
+
+const char * op_name(uint8_t op)
+{
+    return (op < OP_COUNT) ? op_names[op] : "?";
+}
+
+
+// ================================ DECODE TABLES ===================================
+// Two-level tables generated at compile time from rv_insn_table. Level 1 is
+// indexed by opcode[6:2] and funct3. A level 1 slot holds either the single
+// instruction row that can match there, or the level 2 group that tells
+// several rows apart by funct7 and bit 20. Entries hold row+1 (0: illegal).
+// The row's mask/match is checked last, so fields the tables do not look at
+// are still validated.
+#define DECODE_L1_INDEX(x)  ((((x) >> 2) & 0x1f) << 3 | RV_FUNCT3(x))
+#define DECODE_L2_INDEX(x)  (RV_FUNCT7(x) << 1 | (((x) >> 20) & 0x1))
+#define DECODE_GROUP        0x80
+
+static_assert(RV_INSN_COUNT < DECODE_GROUP, "instruction table too large for 8-bit decode entries");
+
+struct DecodeTables
+{
+    static const uint32_t L1_SIZE = 256;
+    static const uint32_t L2_SIZE = 256;
+    static const uint32_t MAX_GROUPS = 16;
+
+    uint8_t l1[L1_SIZE];
+    uint8_t l2[MAX_GROUPS][L2_SIZE];
+};
+
+// instruction bits covered by the level 1 / level 2 index
+static constexpr uint32_t decode_l1_bits(uint32_t i)  { return ((i >> 3) << 2) | 0x3 | ((i & 0x7) << 12); }
+static constexpr uint32_t decode_l2_bits(uint32_t j)  { return ((j >> 1) << 25) | ((j & 0x1) << 20); }
+
+static constexpr bool decode_covers(const RVInsnSpec & s, uint32_t bits, uint32_t field_mask)
+{
+    return ((bits ^ s.match) & s.mask & field_mask) == 0;
+}
+
+static constexpr DecodeTables build_decode_tables(uint32_t ext)
+{
+    const uint32_t L1_FIELDS = 0x0000707f;
+    const uint32_t L2_FIELDS = 0xfe100000;
+
+    DecodeTables t = {};
+    uint32_t groups = 0;
+
+    for(uint32_t i=0; i<DecodeTables::L1_SIZE; i++)
+    {
+        uint32_t rows = 0;
+        uint8_t entry = 0;
+        for(uint32_t r=0; r<RV_INSN_COUNT; r++)
+        {
+            if((rv_insn_table[r].ext & ext) && decode_covers(rv_insn_table[r], decode_l1_bits(i), L1_FIELDS))
+            {
+                rows++;
+                entry = r+1;
+            }
+        }
+
+        if(rows <= 1)
+        {
+            t.l1[i] = entry;
+            continue;
+        }
+
+        // several rows share this slot: split them on funct7 / bit 20
+        if(groups == DecodeTables::MAX_GROUPS)
+            throw "decode tables: too many level 2 groups";
+
+        for(uint32_t j=0; j<DecodeTables::L2_SIZE; j++)
+        {
+            for(uint32_t r=0; r<RV_INSN_COUNT; r++)
+            {
+                if((rv_insn_table[r].ext & ext)
+                    && decode_covers(rv_insn_table[r], decode_l1_bits(i), L1_FIELDS)
+                    && decode_covers(rv_insn_table[r], decode_l2_bits(j), L2_FIELDS))
+                {
+                    if(t.l2[groups][j])
+                        throw "decode tables: ambiguous instruction encoding";
+                    t.l2[groups][j] = r+1;
+                }
+            }
+        }
+        t.l1[i] = DECODE_GROUP | groups;
+        groups++;
+    }
+    return t;
+}
+
+template<uint32_t EXT>
+static constexpr DecodeTables decode_tables = build_decode_tables(EXT);
+
+
+template<uint32_t EXT>
+void decode(uint32_t insn, DecodedInsn & d)
+{
+    uint8_t e = decode_tables<EXT>.l1[DECODE_L1_INDEX(insn)];
+    if(e & DECODE_GROUP)
+        e = decode_tables<EXT>.l2[e & ~DECODE_GROUP][DECODE_L2_INDEX(insn)];
+
+    d.rd = RV_RD(insn) ? RV_RD(insn) : RV_REG_SINK;
+    d.rs1 = RV_RS1(insn);
+    d.rs2 = RV_RS2(insn);
+
+    if(e == 0 || (insn & rv_insn_table[e-1].mask) != rv_insn_table[e-1].match)
+    {
+        // keep the raw word for illegal instructions (reporting)
+        d.op = OP_ILLEGAL;
+        d.imm = (int32_t)insn;
+        d.exec = exec_table[OP_ILLEGAL];
+        return;
+    }
+
+    const RVInsnSpec & s = rv_insn_table[e-1];
+    d.op = s.op;
+    switch(s.fmt)
+    {
+        case FMT_R:     d.imm = 0; break;
+        case FMT_I:     d.imm = RV_IMM_I(insn); break;
+        case FMT_SHAMT: d.imm = RV_RS2(insn); break;
+        case FMT_S:     d.imm = RV_IMM_S(insn); break;
+        case FMT_B:     d.imm = RV_IMM_B(insn); break;
+        case FMT_U:     d.imm = RV_IMM_U(insn); break;
+        case FMT_J:     d.imm = RV_IMM_J(insn); break;
+    }
+    d.exec = exec_table[d.op];
+}
+
+#define RV_ISA_INSTANTIATE(name, ext) template void decode<ext>(uint32_t insn, DecodedInsn & d);
+RV_ISA_VARIANTS(RV_ISA_INSTANTIATE)
+#undef RV_ISA_INSTANTIATE
+
+
+bool fuse(DecodedInsn & first, const DecodedInsn & second)
+{
+    uint8_t fused = OP_UNDECODED;
+
+    switch(first.op)
+    {
+        case OP_LUI:
+            // lui rd, hi; addi rd, rd, lo  =>  rd = 32-bit constant
+            if(second.op == OP_ADDI && first.rd != RV_REG_SINK && second.rs1 == first.rd && second.rd == first.rd)
+            {
+                first.imm += second.imm;
+                fused = OP_FUSE_LUI_ADDI;
+            }
+            break;
+
+        case OP_AUIPC:
+            // auipc rt, hi; jalr rd, lo(rt)  =>  far call / tail call
+            if(second.op == OP_JALR && second.rs1 == first.rd && first.rd != RV_REG_SINK)
+                fused = OP_FUSE_AUIPC_JALR;
+            // auipc rt, hi; lw rd, lo(rt)  =>  pc-relative load
+            else if(second.op == OP_LW && second.rs1 == first.rd && first.rd != RV_REG_SINK)
+                fused = OP_FUSE_AUIPC_LW;
+            break;
+
+        case OP_SLLI:
+            // slli rd, rs, a; srli rd, rd, b  =>  bit-field extract / zero extend
+            if(second.op == OP_SRLI && first.rd != RV_REG_SINK && second.rs1 == first.rd && second.rd == first.rd)
+                fused = OP_FUSE_SLLI_SRLI;
+            break;
+    }
+
+    if(fused == OP_UNDECODED)
+        return false;
+
+    first.op = fused;
+    first.exec = exec_table[fused];
+    return true;
+}
+
+
+// =============================== DECODE CACHE =====================================
+DecodeCache::Page * DecodeCache::get_page(uint32_t tag)
+{
+    std::unique_ptr<Page> & page = pages[tag];
+    if(!page)
+    {
+        page.reset(new Page);
+        reset_page(tag, page.get());
+    }
+    return page.get();
+}
+
+
+void DecodeCache::reset_page(uint32_t tag, Page * page)
+{
+    // generation first, so a store racing with the reset shows up as a
+    // change on the next sync
+    page->gen = mem_map->page_gen(tag << PAGE_BITS);
+    for(uint32_t i=0; i<SLOTS_PER_PAGE; i++)
+    {
+        page->slots[i].op = OP_UNDECODED;
+        page->slots[i].exec = exec_table[OP_UNDECODED];
+    }
+}
+
+
+void DecodeCache::flush()
+{
+    pages.clear();
+    last_page = nullptr;
+}
+
+
+void DecodeCache::invalidate(uint32_t addr)
+{
+    std::unordered_map<uint32_t, std::unique_ptr<Page>>::iterator it = pages.find(addr >> PAGE_BITS);
+    if(it != pages.end())
+    {
+        reset_page(it->first, it->second.get());
+    }
+}
+
+
+void DecodeCache::sync()
+{
+    for(std::unordered_map<uint32_t, std::unique_ptr<Page>>::iterator it = pages.begin(); it != pages.end(); it++)
+    {
+        if(it->second->gen != mem_map->page_gen(it->first << PAGE_BITS))
+        {
+            reset_page(it->first, it->second.get());
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "memmap.h"
+#include "isa.h"
+
+/**
+ * @brief Statically discovered basic block
+ */
+struct CfgBlock
+{
+    uint32_t pc;
+    uint32_t len;   // instructions
+};
+
+/**
+ * @brief Get code roots of an ELF file: defined function symbols (the entry
+ * point is returned by load_elf())
+ *
+ * @param file ELF file
+ * @return std::vector<uint32_t> root addresses, empty if file is not an ELF file
+ */
+std::vector<uint32_t> elf_code_roots(const std::string & file);
+
+/**
+ * @brief Find basic blocks reachable through direct control flow
+ * Follows branch/jump targets, fall-through paths and the return sites of
+ * calls starting from the roots. Blocks end where translated blocks end (see
+ * RVCore::_translate), so every block found is one the block engine would
+ * look up. Indirect jump targets other than return sites are not found.
+ *
+ * @param mem_map memory map (code must already be loaded)
+ * @param isa ISA variant used for decoding
+ * @param roots start addresses
+ * @return std::vector<CfgBlock> blocks, in discovery order
+ */
+std::vector<CfgBlock> cfg_discover(MemMap & mem_map, const RVIsa * isa, const std::vector<uint32_t> & roots);
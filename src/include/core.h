@@ -2,33 +2,59 @@
 #include <vector>
 #include <stdint.h>
 #include "memsim.h"
+#include "memmap.h"
+#include "decode.h"
+#include "tcache.h"
+#include "jit.h"
+#include "tiering.h"
+#include "isa.h"
+#include "cfg.h"
 
-class RVCore
+// Cores are aligned to host cache lines so harts running on different
+// threads never share a line
+class alignas(RVSIM_CACHE_LINE) RVCore
 {
     public:
+    /**
+     * @brief Register file
+     * x0..x31 plus the x0 write sink (see RV_REG_SINK); x0 is never written
+     * and stays zero, so reads and writes are plain indexed accesses
+     */
     class RF
     {
         private:
-        uint32_t regs[31];
+        uint32_t regs[RV_REG_SLOTS] = {};
 
         public:
+        uint32_t & operator[](uint8_t rnum)
+        {
+            return regs[rnum];
+        }
+
         uint32_t get(uint8_t rnum)
         {
-            return (rnum==0) ? 0 : regs[rnum-1];
+            return regs[rnum];
         }
 
+        /**
+         * @brief Write a register; rnum must be a decoded rd (x0 as RV_REG_SINK)
+         */
         void set(uint8_t rnum, uint32_t value)
         {
-            if(rnum==0)
-            {
-                return;
-            }
-            regs[rnum-1] = value;
+            regs[rnum] = value;
+        }
+
+        /**
+         * @brief Raw register storage (indexed by register number)
+         */
+        uint32_t * data()
+        {
+            return regs;
         }
 
         void clear()
         {
-            for(int i=1; i<32; i++)
+            for(int i=0; i<RV_REG_SLOTS; i++)
             {
                 regs[i] = 0;
             }
@@ -37,7 +63,15 @@ class RVCore
 
 
 
-    RVCore(uint32_t id, std::vector<Memory> * mem, uint32_t reset_addr);
+    RVCore(uint32_t id, MemMap * mem_map, uint32_t reset_addr, const RVIsa * isa);
+
+    /**
+     * @brief Get the pre-instantiated variant for an extension set
+     *
+     * @param ext extension set (see rv_isa_parse())
+     * @return const RVIsa* variant, nullptr if no variant implements ext
+     */
+    static const RVIsa * isa_variant(uint32_t ext);
 
     void reset();
 
@@ -45,6 +79,47 @@ class RVCore
 
     void run();
 
+    /**
+     * @brief Run using threaded dispatch; each handler jumps straight to the
+     * handler of the next instruction instead of returning to tick()
+     */
+    void run_threaded()
+    {
+        (this->*isa->run_threaded)();
+    }
+
+    /**
+     * @brief Run using the translation cache; executes whole blocks at a time
+     * and follows direct links between blocks once they are known. Blocks move
+     * from interpretation to translated to native code as they get hot
+     * (see TierManager).
+     */
+    void run_blocks();
+
+    /**
+     * @brief Translate statically discovered code ahead of execution
+     * Done once for all cores (they share memory and ISA variant), see
+     * use_pretranslation(). Block engines get translated blocks, the other
+     * engines predecoded instructions.
+     *
+     * @param mem_map memory map (code must already be loaded)
+     * @param isa ISA variant used for decoding
+     * @param blocks blocks to translate (see cfg_discover())
+     * @param threads number of host threads used to build blocks
+     * @return Pretranslation translated code
+     */
+    static Pretranslation pretranslate(MemMap & mem_map, const RVIsa * isa, const std::vector<CfgBlock> & blocks, unsigned threads);
+
+    /**
+     * @brief Start from pretranslated code
+     * Block engines get copies of the blocks in their translation cache (so
+     * they skip the interpreter tier), the other engines get the instructions
+     * in their decode cache.
+     *
+     * @param p code translated by pretranslate()
+     */
+    void use_pretranslation(const Pretranslation & p);
+
     bool is_halted()
     {
         return halted;
@@ -55,29 +130,149 @@ class RVCore
         return id;
     }
 
+    uint64_t get_instret()
+    {
+        return instret;
+    }
+
+    /**
+     * @brief Set tier promotion thresholds (used by the tiered engine)
+     *
+     * @param t thresholds
+     */
+    void set_tiering(const SimConfig::Tiering & t)
+    {
+        tiers.threaded_threshold = t.threaded_threshold;
+        tiers.native_threshold = t.native_threshold;
+    }
+
+    /**
+     * @brief Get number of blocks in each execution tier
+     *
+     * @param counts blocks per TierManager::Tier
+     */
+    void get_tier_counts(size_t counts[TierManager::TIER_COUNT])
+    {
+        size_t native = tcache.native_count();
+        counts[TierManager::TIER_INTERP] = tiers.interp_blocks();
+        counts[TierManager::TIER_THREADED] = tcache.size() - native;
+        counts[TierManager::TIER_NATIVE] = native;
+    }
+
     
     private:
-    // core_id
-    uint32_t id;
+    // Hot state: everything the execution loops touch on every instruction
+    // sits in the first three cache lines of the (cache line aligned) core.
+    // The register file alone is 132 bytes, so the scalars go first and
+    // share a line with x0..x2 (checked in core.cpp).
 
-    // Register file
-    RF reg_file;
+    // decode slot of the instruction being executed
+    DecodedInsn * cur = nullptr;
+
+    // ISA variant (decoder & execution loops for the enabled extensions)
+    const RVIsa * isa;
+
+    // Sim Memory
+    MemMap * mem_map = nullptr;
+
+    // retired instruction count
+    uint64_t instret = 0;
+
+    // traps taken; they count against the --maxitr budget like retired
+    // instructions, so a handler that faults itself cannot run forever
+    uint64_t traps = 0;
 
     // program counter
     uint32_t pc;
 
-    // reset address
-    uint32_t reset_addr;
-
     // instruction register
     uint32_t ir;
 
-    // Sim Memory
-    std::vector<Memory> * sim_mem = nullptr;
-
     // Halted/Running
     bool halted;
 
+    // set by _trap(); engines stop executing the current instruction's
+    // successors and do not retire it
+    bool trapped = false;
+
+    // Register file
+    RF reg_file;
+
+    // Cold state
+
+    // core_id
+    alignas(RVSIM_CACHE_LINE) uint32_t id;
+
+    // reset address
+    uint32_t reset_addr;
+
+    // Predecoded instructions
+    DecodeCache dcache;
+
+    // Translated blocks
+    BlockCache tcache;
+
+    // Return address prediction for the block engine
+    ReturnStack ras;
+
+    // set when translated blocks may be stale (store to a code page, fence.i);
+    // the block engine syncs them at the next block boundary
+    bool code_stale = false;
+
+    // Tier promotion policy
+    TierManager tiers;
+
+    // Native code for hot blocks
+    bool jit_enabled = false;
+    std::unique_ptr<CodeBuffer> jit_buf;
+    friend struct RVJit;
+
+    bool _jit_compile(TBlock * b);
+    template<uint32_t EXT> void _run_threaded();
+    template<uint32_t EXT> void _exec_block(const TBlock * b);
+    void _interp_block();
+    void _flush_translations();
+
+    TBlock * _translate(uint32_t pc);
+    static TBlock * _build_block(MemMap * mem_map, const RVIsa * isa, uint32_t start, uint32_t & gen);
+
+    friend struct RVExec;
+
+    // Machine mode trap state; writing mtvec installs the trap handler
+    bool trap_handler = false;
+    uint32_t mstatus = 0;
+    uint32_t mtvec = 0;
+    uint32_t mscratch = 0;
+    uint32_t mepc = 0;
+    uint32_t mcause = 0;
+    uint32_t mtval = 0;
+
+    /**
+     * @brief Raise an exception: the current instruction (at pc) does not
+     * complete and the hart continues at the trap handler. Without a trap
+     * handler (or when the handler itself cannot be fetched) the simulation
+     * stops with an error, as faults always did.
+     *
+     * @param cause exception code (RV_EXC_*)
+     * @param tval faulting address or instruction (mtval)
+     */
+    COLD void _trap(uint32_t cause, uint32_t tval);
+    bool _csr_read(uint32_t csr, uint32_t & value);
+    bool _csr_write(uint32_t csr, uint32_t value);
+
+    // LR/SC: address reserved by the last lr.w and the value it loaded
+    bool res_valid = false;
+    uint32_t res_addr = 0;
+    uint32_t res_value = 0;
+
+    // Memory access
+    uint32_t * _amo_ptr(uint32_t addr, uint32_t perm);
+    uint32_t _fetch_word(uint32_t addr);
+    uint32_t _load(uint32_t addr, uint32_t len);
+    void _store(uint32_t addr, uint32_t len, uint32_t value);
+    COLD void _mem_fault(uint32_t addr, uint32_t len, uint32_t perm);
+    void _code_written(uint32_t addr, uint32_t len);
+
     void _fetch();
     void _decode();
     void _execute();
@@ -0,0 +1,442 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <unordered_map>
+#include "isa.h"
+
+class RVCore;
+class MemMap;
+struct DecodedInsn;
+
+/**
+ * @brief Instruction handler; executes one decoded instruction and advances pc
+ */
+typedef void (*ExecFn)(RVCore & core, const DecodedInsn & d);
+
+/**
+ * @brief List of all operations known to the decoder
+ * (X-macro, used to generate enums & handler tables)
+ */
+#define RV_OP_LIST(X)   \
+    X(UNDECODED)        \
+    X(BLOCK_END)        \
+    X(ILLEGAL)          \
+    X(LUI)              \
+    X(AUIPC)            \
+    X(JAL)              \
+    X(JALR)             \
+    X(BEQ)              \
+    X(BNE)              \
+    X(BLT)              \
+    X(BGE)              \
+    X(BLTU)             \
+    X(BGEU)             \
+    X(LB)               \
+    X(LH)               \
+    X(LW)               \
+    X(LBU)              \
+    X(LHU)              \
+    X(SB)               \
+    X(SH)               \
+    X(SW)               \
+    X(ADDI)             \
+    X(SLTI)             \
+    X(SLTIU)            \
+    X(XORI)             \
+    X(ORI)              \
+    X(ANDI)             \
+    X(SLLI)             \
+    X(SRLI)             \
+    X(SRAI)             \
+    X(ADD)              \
+    X(SUB)              \
+    X(SLL)              \
+    X(SLT)              \
+    X(SLTU)             \
+    X(XOR)              \
+    X(SRL)              \
+    X(SRA)              \
+    X(OR)               \
+    X(AND)              \
+    X(FENCE)            \
+    X(FENCE_I)          \
+    X(ECALL)            \
+    X(EBREAK)           \
+    X(MRET)             \
+    X(CSRRW)            \
+    X(CSRRS)            \
+    X(CSRRC)            \
+    X(CSRRWI)           \
+    X(CSRRSI)           \
+    X(CSRRCI)           \
+    X(MUL)              \
+    X(MULH)             \
+    X(MULHSU)           \
+    X(MULHU)            \
+    X(DIV)              \
+    X(DIVU)             \
+    X(REM)              \
+    X(REMU)             \
+    X(LR_W)             \
+    X(SC_W)             \
+    X(AMOSWAP_W)        \
+    X(AMOADD_W)         \
+    X(AMOXOR_W)         \
+    X(AMOAND_W)         \
+    X(AMOOR_W)          \
+    X(AMOMIN_W)         \
+    X(AMOMAX_W)         \
+    X(AMOMINU_W)        \
+    X(AMOMAXU_W)        \
+    X(FUSE_LUI_ADDI)    \
+    X(FUSE_AUIPC_JALR)  \
+    X(FUSE_AUIPC_LW)    \
+    X(FUSE_SLLI_SRLI)
+
+enum RVOp : uint8_t
+{
+    #define RV_OP_ENUM(name) OP_##name,
+    RV_OP_LIST(RV_OP_ENUM)
+    #undef RV_OP_ENUM
+    OP_COUNT
+};
+
+
+/**
+ * @brief Register file slots: x0..x31 plus a sink slot that takes the writes
+ * to x0. The decoder maps rd=x0 to RV_REG_SINK, so handlers write rd without
+ * checking for x0 and x0 itself always reads as zero.
+ */
+#define RV_REG_SINK     32
+#define RV_REG_SLOTS    33
+
+
+/**
+ * @brief Predecoded instruction record
+ * Holds everything needed to execute an instruction without looking at
+ * the raw instruction word again
+ */
+struct DecodedInsn
+{
+    ExecFn exec;        // handler
+    uint8_t op;         // RVOp
+    uint8_t rd;         // RV_REG_SINK if the destination is x0
+    uint8_t rs1;
+    uint8_t rs2;
+    int32_t imm;        // sign-extended immediate
+};
+
+
+/**
+ * @brief Instruction formats (select how the immediate is extracted)
+ */
+enum RVFormat : uint8_t
+{
+    FMT_R,
+    FMT_I,
+    FMT_SHAMT,          // I-type with the shift amount in the rs2 field
+    FMT_S,
+    FMT_B,
+    FMT_U,
+    FMT_J
+};
+
+
+/**
+ * @brief Instruction description
+ * An instruction word is op if (insn & mask) == match; op also selects the
+ * handler (RVExec::<op>). The decoder tables are generated from these rows at
+ * compile time, so adding instructions means adding rows here.
+ */
+struct RVInsnSpec
+{
+    uint32_t mask;
+    uint32_t match;
+    uint8_t fmt;        // RVFormat
+    uint8_t op;         // RVOp
+    uint32_t ext;       // RV_EXT_*
+};
+
+constexpr RVInsnSpec rv_insn_table[] =
+{
+    // RV32I
+    {0x0000007f, 0x00000037, FMT_U,     OP_LUI,     RV_EXT_I},
+    {0x0000007f, 0x00000017, FMT_U,     OP_AUIPC,   RV_EXT_I},
+    {0x0000007f, 0x0000006f, FMT_J,     OP_JAL,     RV_EXT_I},
+    {0x0000707f, 0x00000067, FMT_I,     OP_JALR,    RV_EXT_I},
+    {0x0000707f, 0x00000063, FMT_B,     OP_BEQ,     RV_EXT_I},
+    {0x0000707f, 0x00001063, FMT_B,     OP_BNE,     RV_EXT_I},
+    {0x0000707f, 0x00004063, FMT_B,     OP_BLT,     RV_EXT_I},
+    {0x0000707f, 0x00005063, FMT_B,     OP_BGE,     RV_EXT_I},
+    {0x0000707f, 0x00006063, FMT_B,     OP_BLTU,    RV_EXT_I},
+    {0x0000707f, 0x00007063, FMT_B,     OP_BGEU,    RV_EXT_I},
+    {0x0000707f, 0x00000003, FMT_I,     OP_LB,      RV_EXT_I},
+    {0x0000707f, 0x00001003, FMT_I,     OP_LH,      RV_EXT_I},
+    {0x0000707f, 0x00002003, FMT_I,     OP_LW,      RV_EXT_I},
+    {0x0000707f, 0x00004003, FMT_I,     OP_LBU,     RV_EXT_I},
+    {0x0000707f, 0x00005003, FMT_I,     OP_LHU,     RV_EXT_I},
+    {0x0000707f, 0x00000023, FMT_S,     OP_SB,      RV_EXT_I},
+    {0x0000707f, 0x00001023, FMT_S,     OP_SH,      RV_EXT_I},
+    {0x0000707f, 0x00002023, FMT_S,     OP_SW,      RV_EXT_I},
+    {0x0000707f, 0x00000013, FMT_I,     OP_ADDI,    RV_EXT_I},
+    {0x0000707f, 0x00002013, FMT_I,     OP_SLTI,    RV_EXT_I},
+    {0x0000707f, 0x00003013, FMT_I,     OP_SLTIU,   RV_EXT_I},
+    {0x0000707f, 0x00004013, FMT_I,     OP_XORI,    RV_EXT_I},
+    {0x0000707f, 0x00006013, FMT_I,     OP_ORI,     RV_EXT_I},
+    {0x0000707f, 0x00007013, FMT_I,     OP_ANDI,    RV_EXT_I},
+    {0xfe00707f, 0x00001013, FMT_SHAMT, OP_SLLI,    RV_EXT_I},
+    {0xfe00707f, 0x00005013, FMT_SHAMT, OP_SRLI,    RV_EXT_I},
+    {0xfe00707f, 0x40005013, FMT_SHAMT, OP_SRAI,    RV_EXT_I},
+    {0xfe00707f, 0x00000033, FMT_R,     OP_ADD,     RV_EXT_I},
+    {0xfe00707f, 0x40000033, FMT_R,     OP_SUB,     RV_EXT_I},
+    {0xfe00707f, 0x00001033, FMT_R,     OP_SLL,     RV_EXT_I},
+    {0xfe00707f, 0x00002033, FMT_R,     OP_SLT,     RV_EXT_I},
+    {0xfe00707f, 0x00003033, FMT_R,     OP_SLTU,    RV_EXT_I},
+    {0xfe00707f, 0x00004033, FMT_R,     OP_XOR,     RV_EXT_I},
+    {0xfe00707f, 0x00005033, FMT_R,     OP_SRL,     RV_EXT_I},
+    {0xfe00707f, 0x40005033, FMT_R,     OP_SRA,     RV_EXT_I},
+    {0xfe00707f, 0x00006033, FMT_R,     OP_OR,      RV_EXT_I},
+    {0xfe00707f, 0x00007033, FMT_R,     OP_AND,     RV_EXT_I},
+    {0x0000707f, 0x0000000f, FMT_I,     OP_FENCE,   RV_EXT_I},
+    {0x0000707f, 0x0000100f, FMT_I,     OP_FENCE_I, RV_EXT_I},
+    {0xffffffff, 0x00000073, FMT_I,     OP_ECALL,   RV_EXT_I},
+    {0xffffffff, 0x00100073, FMT_I,     OP_EBREAK,  RV_EXT_I},
+    {0xffffffff, 0x30200073, FMT_I,     OP_MRET,    RV_EXT_I},
+
+    // Zicsr (machine mode CSRs are always there, see RVCore::_csr_read())
+    {0x0000707f, 0x00001073, FMT_I,     OP_CSRRW,   RV_EXT_I},
+    {0x0000707f, 0x00002073, FMT_I,     OP_CSRRS,   RV_EXT_I},
+    {0x0000707f, 0x00003073, FMT_I,     OP_CSRRC,   RV_EXT_I},
+    {0x0000707f, 0x00005073, FMT_I,     OP_CSRRWI,  RV_EXT_I},
+    {0x0000707f, 0x00006073, FMT_I,     OP_CSRRSI,  RV_EXT_I},
+    {0x0000707f, 0x00007073, FMT_I,     OP_CSRRCI,  RV_EXT_I},
+
+    // M
+    {0xfe00707f, 0x02000033, FMT_R,     OP_MUL,     RV_EXT_M},
+    {0xfe00707f, 0x02001033, FMT_R,     OP_MULH,    RV_EXT_M},
+    {0xfe00707f, 0x02002033, FMT_R,     OP_MULHSU,  RV_EXT_M},
+    {0xfe00707f, 0x02003033, FMT_R,     OP_MULHU,   RV_EXT_M},
+    {0xfe00707f, 0x02004033, FMT_R,     OP_DIV,     RV_EXT_M},
+    {0xfe00707f, 0x02005033, FMT_R,     OP_DIVU,    RV_EXT_M},
+    {0xfe00707f, 0x02006033, FMT_R,     OP_REM,     RV_EXT_M},
+    {0xfe00707f, 0x02007033, FMT_R,     OP_REMU,    RV_EXT_M},
+
+    // A (aq/rl bits 26:25 are not decoded: all AMOs are sequentially consistent)
+    {0xf9f0707f, 0x1000202f, FMT_R,     OP_LR_W,      RV_EXT_A},
+    {0xf800707f, 0x1800202f, FMT_R,     OP_SC_W,      RV_EXT_A},
+    {0xf800707f, 0x0800202f, FMT_R,     OP_AMOSWAP_W, RV_EXT_A},
+    {0xf800707f, 0x0000202f, FMT_R,     OP_AMOADD_W,  RV_EXT_A},
+    {0xf800707f, 0x2000202f, FMT_R,     OP_AMOXOR_W,  RV_EXT_A},
+    {0xf800707f, 0x6000202f, FMT_R,     OP_AMOAND_W,  RV_EXT_A},
+    {0xf800707f, 0x4000202f, FMT_R,     OP_AMOOR_W,   RV_EXT_A},
+    {0xf800707f, 0x8000202f, FMT_R,     OP_AMOMIN_W,  RV_EXT_A},
+    {0xf800707f, 0xa000202f, FMT_R,     OP_AMOMAX_W,  RV_EXT_A},
+    {0xf800707f, 0xc000202f, FMT_R,     OP_AMOMINU_W, RV_EXT_A},
+    {0xf800707f, 0xe000202f, FMT_R,     OP_AMOMAXU_W, RV_EXT_A},
+};
+
+constexpr uint32_t RV_INSN_COUNT = sizeof(rv_insn_table) / sizeof(rv_insn_table[0]);
+
+
+/**
+ * @brief Extension an operation belongs to (from the instruction table;
+ * internal and fused operations count as base ISA)
+ *
+ * @param op RVOp
+ * @return uint32_t RV_EXT_*
+ */
+constexpr uint32_t op_ext(uint8_t op)
+{
+    for(uint32_t i=0; i<RV_INSN_COUNT; i++)
+    {
+        if(rv_insn_table[i].op == op)
+            return rv_insn_table[i].ext;
+    }
+    return RV_EXT_I;
+}
+
+
+/**
+ * @brief Check if an operation is part of an extension set
+ *
+ * @param ext extension set
+ * @param op RVOp
+ * @return true if enabled
+ */
+constexpr bool op_enabled(uint32_t ext, uint8_t op)
+{
+    return (op_ext(op) & ext) != 0;
+}
+
+
+/**
+ * @brief Decode a 32-bit instruction word; instructions outside the
+ * extension set EXT decode as OP_ILLEGAL
+ *
+ * @param insn instruction word
+ * @param d decoded record to fill
+ */
+template<uint32_t EXT>
+void decode(uint32_t insn, DecodedInsn & d);
+
+
+/**
+ * @brief Get handler of an operation
+ *
+ * @param op RVOp
+ * @return ExecFn handler
+ */
+ExecFn op_handler(uint8_t op);
+
+
+/**
+ * @brief Check if an operation ends a translated block
+ * (control transfers and instructions that stop or redirect the hart)
+ *
+ * @param op RVOp
+ * @return true if op ends a block
+ */
+inline bool op_ends_block(uint8_t op)
+{
+    switch(op)
+    {
+        case OP_JAL: case OP_JALR:
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+        case OP_FENCE_I: case OP_ECALL: case OP_EBREAK: case OP_MRET: case OP_ILLEGAL:
+        case OP_FUSE_AUIPC_JALR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/**
+ * @brief Check if an operation can raise a trap (see RVCore::_trap()); the
+ * engines only look for traps after these
+ *
+ * @param op RVOp
+ * @return true if op may trap
+ */
+constexpr bool op_may_trap(uint8_t op)
+{
+    switch(op)
+    {
+        case OP_UNDECODED: case OP_ILLEGAL:
+        case OP_JAL: case OP_JALR:
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+        case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+        case OP_SB: case OP_SH: case OP_SW:
+        case OP_CSRRW: case OP_CSRRS: case OP_CSRRC: case OP_CSRRWI: case OP_CSRRSI: case OP_CSRRCI:
+        case OP_LR_W: case OP_SC_W: case OP_AMOSWAP_W: case OP_AMOADD_W: case OP_AMOXOR_W: case OP_AMOAND_W:
+        case OP_AMOOR_W: case OP_AMOMIN_W: case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W:
+        case OP_FUSE_AUIPC_JALR: case OP_FUSE_AUIPC_LW:
+        case OP_ECALL: case OP_EBREAK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/**
+ * @brief Number of decoded records (= guest instructions) an operation covers;
+ * fused operations consume their own record and the one after it
+ *
+ * @param op RVOp
+ * @return uint32_t record count
+ */
+constexpr uint32_t op_records(uint8_t op)
+{
+    return (op == OP_FUSE_LUI_ADDI || op == OP_FUSE_AUIPC_JALR || op == OP_FUSE_AUIPC_LW || op == OP_FUSE_SLLI_SRLI) ? 2 : 1;
+}
+
+
+/**
+ * @brief Try to fuse two consecutive decoded instructions into one operation
+ * (lui+addi, auipc+jalr, auipc+lw, slli+srli). On success first gets the
+ * fused op and second must stay right after it; second is left untouched.
+ *
+ * @param first first instruction
+ * @param second following instruction
+ * @return true if fused
+ */
+bool fuse(DecodedInsn & first, const DecodedInsn & second);
+
+
+/**
+ * @brief Get name of an operation
+ *
+ * @param op RVOp
+ * @return const char* name
+ */
+const char * op_name(uint8_t op);
+
+
+/**
+ * @brief Per-page predecode cache
+ * Maps a pc to its decoded record, records are decoded lazily the first time
+ * they are fetched (slots start out as OP_UNDECODED). Pages remember the
+ * memory map generation they were decoded from (see MemMap::code_written()).
+ */
+class DecodeCache
+{
+    public:
+    static const uint32_t PAGE_BITS = 12;
+    static const uint32_t PAGE_SIZE = 1 << PAGE_BITS;
+    static const uint32_t SLOTS_PER_PAGE = PAGE_SIZE / 4;
+
+    struct Page
+    {
+        DecodedInsn slots[SLOTS_PER_PAGE];
+        uint32_t gen;
+    };
+
+    DecodeCache(MemMap * mem_map) :
+        mem_map(mem_map)
+    {}
+
+    /**
+     * @brief Get decode slot for a (word aligned) pc
+     *
+     * @param pc program counter
+     * @return DecodedInsn* slot
+     */
+    DecodedInsn * lookup(uint32_t pc)
+    {
+        uint32_t tag = pc >> PAGE_BITS;
+        if(tag != last_tag || !last_page)
+        {
+            last_page = get_page(tag);
+            last_tag = tag;
+        }
+        return &last_page->slots[(pc & (PAGE_SIZE-1)) >> 2];
+    }
+
+    /**
+     * @brief Drop all decoded records
+     */
+    void flush();
+
+    /**
+     * @brief Forget the decoded records of the page containing addr; pages are
+     * reset in place, so pointers to their slots stay valid
+     *
+     * @param addr guest address
+     */
+    void invalidate(uint32_t addr);
+
+    /**
+     * @brief Invalidate all pages written since they were decoded
+     */
+    void sync();
+
+    private:
+    MemMap * mem_map;
+    std::unordered_map<uint32_t, std::unique_ptr<Page>> pages;
+    uint32_t last_tag = 0;
+    Page * last_page = nullptr;
+
+    Page * get_page(uint32_t tag);
+    void reset_page(uint32_t tag, Page * page);
+};
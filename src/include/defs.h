@@ -17,6 +17,12 @@ struct SimArgs
     std::string signature_file;
     std::string isa_string;
     std::string sim_config_json_file;
+    std::string engine;
+    bool pretranslate;
+    uint32_t pretranslate_threads;
+    std::string inp_format;
+    uint32_t load_addr;
+    bool lazy_load;
 };
 
 
@@ -39,8 +45,20 @@ struct SimConfig
             bool w;
             bool x;
         } permission;
+
+        std::string backend;    // "heap", "mmap", "file", "shm"
+        bool hugepage;
+        std::string path;       // backing file / shared memory object
+        bool shared;            // file: stores go to the file
+    };
+
+    struct Tiering
+    {
+        uint32_t threaded_threshold;
+        uint32_t native_threshold;
     };
 
     std::vector<Core> cores;
     std::vector<MemBlk> memories;
+    Tiering tiering;
 };
\ No newline at end of file
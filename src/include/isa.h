@@ -0,0 +1,46 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+
+class RVCore;
+struct DecodedInsn;
+struct TBlock;
+
+// ISA extensions
+#define RV_EXT_I    (1u << 0)
+#define RV_EXT_M    (1u << 1)
+#define RV_EXT_A    (1u << 2)
+#define RV_EXT_F    (1u << 3)
+#define RV_EXT_D    (1u << 4)
+#define RV_EXT_C    (1u << 5)
+
+/**
+ * @brief Pre-instantiated ISA variants (X-macro: name, extension set)
+ * Decoder and execution loops are compiled once per variant and only contain
+ * the extensions of that variant.
+ */
+#define RV_ISA_VARIANTS(X)                      \
+    X(RV32I,    RV_EXT_I)                       \
+    X(RV32IM,   RV_EXT_I | RV_EXT_M)            \
+    X(RV32IMA,  RV_EXT_I | RV_EXT_M | RV_EXT_A)
+
+/**
+ * @brief ISA variant; entry points specialized for one extension set
+ */
+struct RVIsa
+{
+    const char * name;
+    uint32_t ext;
+    void (*decode)(uint32_t insn, DecodedInsn & d);
+    void (RVCore::*run_threaded)();
+    void (RVCore::*exec_block)(const TBlock * b);
+};
+
+/**
+ * @brief Parse an ISA string (e.g. "rv32im", "RV32I_Zifencei")
+ * Throws an error for malformed strings or unsupported extensions
+ *
+ * @param isa_string ISA string
+ * @return uint32_t extension set
+ */
+uint32_t rv_isa_parse(const std::string & isa_string);
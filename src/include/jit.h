@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+class RVCore;
+struct TBlock;
+struct DecodedInsn;
+
+/**
+ * @brief Translated native block
+ * Executes a whole guest block on the register file and returns the next pc
+ */
+typedef uint32_t (*NativeBlockFn)(uint32_t * regs, RVCore * core);
+
+
+/**
+ * @brief Executable memory for native blocks
+ * Bump allocated; when full the owner drops all translations and resets it
+ */
+class CodeBuffer
+{
+    public:
+    static const size_t DEFAULT_SIZE = 16 << 20;
+
+    CodeBuffer(size_t size = DEFAULT_SIZE);
+    ~CodeBuffer();
+
+    CodeBuffer(const CodeBuffer &) = delete;
+    CodeBuffer & operator=(const CodeBuffer &) = delete;
+
+    /**
+     * @brief true if the executable mapping could be created
+     */
+    bool valid() { return base != nullptr; }
+
+    uint8_t * free_ptr() { return base + used; }
+    size_t free_space() { return size - used; }
+    void commit(size_t n) { used += n; }
+    void reset() { used = 0; }
+
+    private:
+    uint8_t * base;
+    size_t size;
+    size_t used;
+};
+
+
+/**
+ * @brief x86-64 JIT for RV32 blocks
+ */
+struct RVJit
+{
+    /**
+     * @brief Check if native translation is supported on this host
+     */
+    static bool available();
+
+    /**
+     * @brief Translate a block to native code
+     *
+     * @param c core running the code (layout of the core state)
+     * @param b block
+     * @param buf code buffer
+     * @return NativeBlockFn native code, nullptr if the buffer is full
+     */
+    static NativeBlockFn compile(RVCore * c, TBlock * b, CodeBuffer & buf);
+
+    // Runtime helpers called from native code; pc is the guest instruction
+    // (reported if the access traps)
+    static uint32_t load8(RVCore * c, uint32_t addr, uint32_t pc);
+    static uint32_t load8u(RVCore * c, uint32_t addr, uint32_t pc);
+    static uint32_t load16(RVCore * c, uint32_t addr, uint32_t pc);
+    static uint32_t load16u(RVCore * c, uint32_t addr, uint32_t pc);
+    static uint32_t load32(RVCore * c, uint32_t addr, uint32_t pc);
+    static void store8(RVCore * c, uint32_t addr, uint32_t value, uint32_t pc);
+    static void store16(RVCore * c, uint32_t addr, uint32_t value, uint32_t pc);
+    static void store32(RVCore * c, uint32_t addr, uint32_t value, uint32_t pc);
+    static uint32_t exec_insn(RVCore * c, const DecodedInsn * d, uint32_t pc);
+    static uint32_t jump_fault(RVCore * c, uint32_t target, uint32_t pc);
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "memmap.h"
+
+/**
+ * @brief Load the PT_LOAD segments of an ELF file into guest memory
+ * Segments are split across the regions they cover; file contents are
+ * copied (or mapped, see Memory::writeFromFile()) and the rest of each
+ * segment (bss) is zeroed.
+ *
+ * @param mem_map memory map
+ * @param file ELF file
+ * @return uint32_t entry point
+ */
+uint32_t load_elf(MemMap & mem_map, const std::string & file);
+
+/**
+ * @brief ELF symbol table entry
+ */
+struct ElfSymbol
+{
+    std::string name;
+    uint32_t value;
+    uint8_t type;       // STT_*
+    uint16_t shndx;     // section index, SHN_UNDEF if undefined
+};
+
+/**
+ * @brief Get the symbols of an ELF file (all SHT_SYMTAB sections)
+ * Only the section headers, symbol and string tables are read, from the
+ * same read only mapping the loader uses.
+ *
+ * @param file ELF file
+ * @return std::vector<ElfSymbol> symbols, empty if file is not a 32-bit
+ * ELF file or has no symbol table
+ */
+std::vector<ElfSymbol> elf_symbols(const std::string & file);
+
+/**
+ * @brief Load a raw binary image into guest memory
+ *
+ * @param mem_map memory map
+ * @param file binary file
+ * @param base guest address of the first byte
+ * @return uint32_t entry point (base)
+ */
+uint32_t load_bin(MemMap & mem_map, const std::string & file, uint32_t base);
+
+/**
+ * @brief Load an Intel HEX or Verilog $readmemh image into guest memory
+ * The file is parsed in place and decoded straight into guest memory.
+ *
+ * @param mem_map memory map
+ * @param file hex file
+ * @param base offset added to all addresses in the file ($readmemh word
+ * addresses are scaled by the word width first)
+ * @return uint32_t entry point: start address record (Intel HEX) or base
+ */
+uint32_t load_hex(MemMap & mem_map, const std::string & file, uint32_t base);
+
+/**
+ * @brief Guess the format of an input file
+ *
+ * @param file input file
+ * @return std::string "elf", "bin", "hex" or empty if unknown
+ */
+std::string image_format(const std::string & file);
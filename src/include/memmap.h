@@ -0,0 +1,214 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#include "util.h"
+#include "memsim.h"
+#include "reservation.h"
+
+// Access permissions
+#define MEM_PERM_R  0x1
+#define MEM_PERM_W  0x2
+#define MEM_PERM_X  0x4
+
+// Page state (MemMap::Entry::perm, besides MEM_PERM_*)
+#define MEM_PAGE_CODE       0x10    // code from the page is cached; stores take the slow path
+#define MEM_PAGE_REGION(p)  ((p) << 8)  // region permissions, kept while MEM_PERM_W is masked
+
+/**
+ * @brief Guest physical memory map
+ * Two-level radix table over the 32-bit address space with one entry per
+ * page. Entries of pages that lie completely inside a region hold the host
+ * address of the page and the region permissions, so translating an address
+ * takes two loads regardless of the number of regions. Pages only partly
+ * covered by a region and accesses crossing a page boundary fall back to a
+ * scan of the regions.
+ */
+class MemMap
+{
+    // Self-modifying code: once code is decoded from a page (mark_code())
+    // the page loses MEM_PERM_W in its entry, so stores to it miss the fast
+    // path. The first store then bumps the page generation and restores the
+    // write permission (code_written()). Cores compare the generation of the
+    // pages they cached code from to find stale code.
+    public:
+    static const uint32_t PAGE_BITS = 12;
+    static const uint32_t PAGE_SIZE = 1 << PAGE_BITS;
+    static const uint32_t PAGE_MASK = PAGE_SIZE - 1;
+    static const uint32_t L2_BITS = 10;
+    static const uint32_t L2_SIZE = 1 << L2_BITS;
+    static const uint32_t L1_SIZE = 1 << (32 - PAGE_BITS - L2_BITS);
+    static_assert(PAGE_BITS == Memory::DIRTY_PAGE_BITS, "dirty pages are map pages");
+
+    struct Entry
+    {
+        uint8_t * host;             // host address of the page, nullptr: not directly mapped
+        std::atomic<uint32_t> perm; // MEM_PERM_*, MEM_PAGE_*
+        std::atomic<uint32_t> gen;  // bumped on stores to the page while it holds code
+        std::atomic<uint64_t> * dirty;  // dirty bitmap word of the page (directly mapped pages)
+    };
+
+    /**
+     * @brief Build the map; regions must not move or be resized afterwards
+     * Throws an error for empty, overlapping or misaligned (base not
+     * 4-byte aligned) regions
+     *
+     * @param regions memory regions
+     */
+    MemMap(std::vector<Memory> & regions);
+
+    MemMap(const MemMap &) = delete;
+    MemMap & operator=(const MemMap &) = delete;
+
+    /**
+     * @brief Translate a guest address to a host pointer
+     *
+     * @param addr guest address
+     * @param len access size in bytes
+     * @param perm required permissions (MEM_PERM_*)
+     * @return uint8_t* host pointer, nullptr if unmapped or not permitted
+     */
+    uint8_t * translate(uint32_t addr, uint32_t len, uint32_t perm)
+    {
+        uint8_t * p = lookup(addr, len, perm);
+        return LIKELY(p != nullptr) ? p : _translate_slow(addr, len, perm);
+    }
+
+    /**
+     * @brief Fast path of translate(); also fails for page crossing accesses,
+     * partly mapped pages and stores to pages holding code
+     *
+     * @param addr guest address
+     * @param len access size in bytes
+     * @param perm required permissions (MEM_PERM_*)
+     * @return uint8_t* host pointer, nullptr if translate() is needed
+     */
+    uint8_t * lookup(uint32_t addr, uint32_t len, uint32_t perm)
+    {
+        const Entry * e = lookup_entry(addr, len, perm);
+        return LIKELY(e != nullptr) ? e->host + (addr & PAGE_MASK) : nullptr;
+    }
+
+    /**
+     * @brief lookup() returning the page entry, so stores can mark the page
+     * dirty without translating the address again (see mark_dirty())
+     *
+     * @return const Entry* entry of a directly mapped page, nullptr if
+     * translate() is needed
+     */
+    const Entry * lookup_entry(uint32_t addr, uint32_t len, uint32_t perm)
+    {
+        const Entry & e = entry(addr);
+        if(LIKELY(e.host && (e.perm.load(std::memory_order_relaxed) & perm) == perm && (addr & PAGE_MASK) + len <= PAGE_SIZE))
+            return &e;
+        return nullptr;
+    }
+
+    /**
+     * @brief Note that code is about to be decoded from the page at addr
+     * (call before reading the instruction)
+     *
+     * @param addr guest address
+     */
+    void mark_code(uint32_t addr)
+    {
+        Entry * table = l1[addr >> (PAGE_BITS + L2_BITS)];
+        Entry & e = table[(addr >> PAGE_BITS) & (L2_SIZE-1)];
+        // fetchable pages always have their own table, the empty one is shared
+        if(table != empty_table && !(e.perm.load(std::memory_order_relaxed) & MEM_PAGE_CODE))
+        {
+            e.perm.fetch_or(MEM_PAGE_CODE);
+            e.perm.fetch_and(~(uint32_t)MEM_PERM_W);
+        }
+    }
+
+    /**
+     * @brief Generation of the page at addr
+     */
+    uint32_t page_gen(uint32_t addr)
+    {
+        return entry(addr).gen.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Account a store to [addr, addr+len); pages holding code get a new
+     * generation and their fast store path back
+     *
+     * @param addr guest address
+     * @param len length in bytes
+     * @return true if the store hit a page holding code
+     */
+    bool code_written(uint32_t addr, uint32_t len);
+
+    /**
+     * @brief Account a store to [addr, addr+len) in the dirty bitmap of its
+     * region (call after the store is performed)
+     *
+     * @param addr guest address
+     * @param len access size in bytes
+     */
+    void mark_dirty(uint32_t addr, uint32_t len)
+    {
+        const Entry & e = entry(addr);
+        if(LIKELY(e.dirty && (addr & PAGE_MASK) + len <= PAGE_SIZE))
+            mark_dirty(e, addr);
+        else
+            _mark_dirty_slow(addr, len);
+    }
+
+    /**
+     * @brief mark_dirty() for an access inside the page of an entry returned
+     * by lookup_entry()
+     *
+     * @param e page entry
+     * @param addr guest address
+     */
+    static void mark_dirty(const Entry & e, uint32_t addr)
+    {
+        uint64_t bit = Memory::dirtyBit(addr);
+        if(!(e.dirty->load(std::memory_order_relaxed) & bit))
+            e.dirty->fetch_or(bit, std::memory_order_release);
+    }
+
+    /**
+     * @brief Find the region containing [addr, addr+len)
+     *
+     * @param addr guest address
+     * @param len length in bytes
+     * @return Memory* region, nullptr if none
+     */
+    Memory * region(uint32_t addr, uint32_t len);
+
+    /**
+     * @brief LR/SC reservations of the harts sharing this memory
+     */
+    ReservationTable reservations;
+
+    private:
+    std::vector<Memory> & regions;
+
+    static Entry empty_table[L2_SIZE];
+
+    // level 1 slots without mapped pages point to a shared empty table
+    Entry * l1[L1_SIZE];
+    std::vector<std::unique_ptr<Entry[]>> tables;
+
+    Entry & entry(uint32_t addr)
+    {
+        return l1[addr >> (PAGE_BITS + L2_BITS)][(addr >> PAGE_BITS) & (L2_SIZE-1)];
+    }
+
+    uint8_t * _translate_slow(uint32_t addr, uint32_t len, uint32_t perm);
+    void _mark_dirty_slow(uint32_t addr, uint32_t len);
+};
+
+
+/**
+ * @brief Permissions of a memory region (MEM_PERM_*)
+ */
+inline uint32_t mem_perm(const Memory & m)
+{
+    return (m.re ? MEM_PERM_R : 0) | (m.we ? MEM_PERM_W : 0) | (m.xe ? MEM_PERM_X : 0);
+}
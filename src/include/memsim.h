@@ -1,9 +1,78 @@
 #pragma once
 
 #include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
 #include "util.h"
 #include "defs.h"
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "guest memory is accessed in host byte order; a little endian host is required"
+#endif
+
+/**
+ * @brief Single-copy atomic load of naturally aligned guest memory
+ * Harts may share memory, so aligned accesses are relaxed host atomics: no
+ * torn values between threads, and the same plain moves as non-atomic
+ * accesses on x86-64 and aarch64
+ *
+ * @param p host address (aligned to sizeof(T))
+ * @return T value
+ */
+template<typename T>
+inline T mem_load_atomic(const uint8_t * p)
+{
+	return __atomic_load_n((const T *)p, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Single-copy atomic store to naturally aligned guest memory
+ * (see mem_load_atomic())
+ *
+ * @param p host address (aligned to sizeof(T))
+ * @param v value
+ */
+template<typename T>
+inline void mem_store_atomic(uint8_t * p, T v)
+{
+	__atomic_store_n((T *)p, v, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Backing store of a memory region
+ */
+enum MemBackend
+{
+	MEM_BACKEND_HEAP,	// zeroed heap buffer, committed up front
+	MEM_BACKEND_MMAP,	// anonymous MAP_NORESERVE mapping, pages are zero-filled on first touch
+	MEM_BACKEND_FILE,	// mapped file; memory past the end of the file reads as zero
+	MEM_BACKEND_SHM		// named POSIX shared memory object
+};
+
+
+/**
+ * @brief How a memory region is backed
+ */
+struct MemBacking
+{
+	MemBackend backend = MEM_BACKEND_HEAP;
+
+	// back the memory with transparent huge pages where possible (MEM_BACKEND_MMAP)
+	bool hugepage = false;
+
+	// file path (MEM_BACKEND_FILE) or object name (MEM_BACKEND_SHM)
+	std::string path;
+
+	// MEM_BACKEND_FILE: write guest stores through to the file (MAP_SHARED),
+	// otherwise they stay private to the simulation (MAP_PRIVATE)
+	bool shared = false;
+};
+
+
 /**
  * @brief Memory class
  * This class is used to emulate the memories in simulation backend
@@ -38,10 +107,30 @@ class Memory
 	bool we;
 	bool xe;
 
+	/**
+	 * @brief Backing store of the memory
+	 */
+	MemBackend backend;
+
+	/**
+	 * @brief Granule of dirty page tracking (4 KB pages)
+	 */
+	static const uint32_t DIRTY_PAGE_BITS = 12;
+
 	/**
 	 * @brief Construct a new Memory object
+	 * 
+	 * @param backing backing store
+	 */
+	Memory(uint32_t base_addr, size_t size, bool re, bool we, bool xe, const MemBacking & backing = MemBacking());
+
+	/**
+	 * @brief Memory owns its buffer: it can be moved but not copied
 	 */
-	Memory(uint32_t base_addr, size_t size, bool re, bool we, bool xe);
+	Memory(Memory && other) noexcept;
+	Memory & operator=(Memory && other) noexcept;
+	Memory(const Memory &) = delete;
+	Memory & operator=(const Memory &) = delete;
 
 
 	/**
@@ -51,6 +140,16 @@ class Memory
 	~Memory();
 
 
+	/**
+	 * @brief Get backend by name ("heap", "mmap", "file", "shm")
+	 * 
+	 * @param name backend name
+	 * @param backend backend
+	 * @return true if name is a known backend
+	 */
+	static bool backendFromString(const std::string & name, MemBackend & backend);
+
+
 	/**
 	 * @brief Check if the address is valid
 	 * 
@@ -63,19 +162,56 @@ class Memory
 		return (addr >= base_addr) && (addr < base_addr+size);
 	}
 
+	/**
+	 * @brief Check if a whole range lies within the memory
+	 * 
+	 * @param addr start address
+	 * @param len length in bytes
+	 * @return true if [addr, addr+len) is within bounds
+	 */
+	bool isValidRange(uint32_t addr, size_t len)
+	{
+		return (addr >= base_addr) && ((uint64_t)addr + len <= (uint64_t)base_addr + size);
+	}
+
 	uint32_t global2local(uint32_t addr)
 	{
 		return addr - base_addr;
 	}
 
 
+	/**
+	 * @brief Fetch a 64-bit double word from memory
+	 * 
+	 * @param addr address
+	 * @return uint64_t data
+	 */
+	uint64_t fetchDoubleWord(uint32_t addr)
+	{
+		uint64_t dw;
+		if(LIKELY(!(addr & 0x7) && isValidRange(addr, 8)))
+			dw = mem_load_atomic<uint64_t>(mem + global2local(addr));
+		else
+			dw = fetchBytes(addr, 8);
+		return dw;
+	}
+
+
 	/**
 	 * @brief Fetch a 32-bit word from memory
 	 * 
 	 * @param addr address
 	 * @return uint32_t data
 	 */
-	uint32_t fetchWord(uint32_t addr);
+	uint32_t fetchWord(uint32_t addr)
+	{
+		uint32_t w;
+		if(LIKELY(!(addr & 0x3) && isValidRange(addr, 4)))
+			w = mem_load_atomic<uint32_t>(mem + global2local(addr));
+		else
+			w = (uint32_t)fetchBytes(addr, 4);
+		return w;
+	}
 
 
 	/**
@@ -84,7 +220,15 @@ class Memory
 	 * @param addr address
 	 * @return uint16_t data
 	 */
-	uint16_t fetchHalfWord(uint32_t addr);
+	uint16_t fetchHalfWord(uint32_t addr)
+	{
+		uint16_t hw;
+		if(LIKELY(!(addr & 0x1) && isValidRange(addr, 2)))
+			hw = mem_load_atomic<uint16_t>(mem + global2local(addr));
+		else
+			hw = (uint16_t)fetchBytes(addr, 2);
+		return hw;
+	}
 
 
 	/**
@@ -96,13 +240,40 @@ class Memory
 	uint8_t fetchByte(uint32_t addr);
 
 
+	/**
+	 * @brief Store a 64-bit double word to memory
+	 * 
+	 * @param addr address
+	 * @param dw double word
+	 */
+	void storeDoubleWord(uint32_t addr, uint64_t dw)
+	{
+		if(LIKELY(!(addr & 0x7) && isValidRange(addr, 8)))
+		{
+			mem_store_atomic<uint64_t>(mem + global2local(addr), dw);
+			setDirty(addr);
+		}
+		else
+			storeBytes(addr, dw, 8);
+	}
+
+
 	/**
 	 * @brief Store a 32-bit word to memory
 	 * 
 	 * @param addr address
 	 * @param w Word
 	 */
-	void storeWord(uint32_t addr, uint32_t w);
+	void storeWord(uint32_t addr, uint32_t w)
+	{
+		if(LIKELY(!(addr & 0x3) && isValidRange(addr, 4)))
+		{
+			mem_store_atomic<uint32_t>(mem + global2local(addr), w);
+			setDirty(addr);
+		}
+		else
+			storeBytes(addr, w, 4);
+	}
 
 
 	/**
@@ -111,7 +282,16 @@ class Memory
 	 * @param addr address
 	 * @param hw halfWord
 	 */
-	void storeHalfWord(uint32_t addr, uint16_t hw);
+	void storeHalfWord(uint32_t addr, uint16_t hw)
+	{
+		if(LIKELY(!(addr & 0x1) && isValidRange(addr, 2)))
+		{
+			mem_store_atomic<uint16_t>(mem + global2local(addr), hw);
+			setDirty(addr);
+		}
+		else
+			storeBytes(addr, hw, 2);
+	}
 
 
 	/**
@@ -124,11 +304,141 @@ class Memory
 
 
 	/**
-	 * @brief Initialize memory from an elf file
-	 * only sections that match flag signatures are loaded
+	 * @brief Copy a range of memory out (single bounds check)
+	 * 
+	 * @param addr start address
+	 * @param dst destination buffer
+	 * @param len length in bytes
+	 */
+	void read(uint32_t addr, void * dst, size_t len);
+
+
+	/**
+	 * @brief Copy a buffer into memory (single bounds check)
+	 * 
+	 * @param addr start address
+	 * @param src source buffer
+	 * @param len length in bytes
+	 */
+	void write(uint32_t addr, const void * src, size_t len);
+
+
+	/**
+	 * @brief Zero a range of memory (single bounds check); whole pages of
+	 * mapped memory are replaced by fresh anonymous pages instead, so they
+	 * cost nothing until used
+	 * 
+	 * @param addr start address
+	 * @param len length in bytes
+	 */
+	void zero(uint32_t addr, size_t len);
+
+
+	/**
+	 * @brief Copy file contents into memory; whole pages of read-only
+	 * memory are mapped from the file instead (copy on write), so they
+	 * share the host page cache
+	 * 
+	 * @param addr start address
+	 * @param src file contents at offset (used for the parts that are copied)
+	 * @param len length in bytes
+	 * @param fd file descriptor of the file
+	 * @param offset file offset of the contents
+	 * @param lazy load whole pages of writable memory when they are first
+	 * touched (userfaultfd; falls back to a private file mapping, then copying)
+	 * @return size_t number of bytes mapped or paged in lazily rather than copied
+	 */
+	size_t writeFromFile(uint32_t addr, const void * src, size_t len, int fd, uint64_t offset, bool lazy=false);
+
+
+	// Dirty page tracking: every store to the memory sets the bit of its
+	// page, so checkpoints and resets only need to copy the pages written
+	// since the bits were last cleared. Bits are set after the store is
+	// performed: a store racing dirtyPages(..., true) is either seen by it
+	// or stays marked.
+
+	/**
+	 * @brief Mark the pages of [addr, addr+len) as written
+	 * 
+	 * @param addr start address
+	 * @param len length in bytes
+	 */
+	void markDirty(uint32_t addr, size_t len);
+
+	/**
+	 * @brief Check if the page holding addr was written
+	 * 
+	 * @param addr address
+	 * @return true if the page is dirty
+	 */
+	bool isDirty(uint32_t addr)
+	{
+		return dirtyWord(addr)->load(std::memory_order_acquire) & dirtyBit(addr);
+	}
+
+	/**
+	 * @brief Collect the written pages
 	 * 
-	 * @param ifile filename
-	 * @param flags_signatures allowed flag signatures
+	 * @param pages receives the guest address of each dirty page (page
+	 * aligned; the first and last page may extend past the memory bounds)
+	 * @param clear clear the bits of the collected pages
+	 * @return size_t number of dirty pages
+	 */
+	size_t dirtyPages(std::vector<uint32_t> & pages, bool clear=false);
+
+	/**
+	 * @brief Mark all pages clean
+	 */
+	void clearDirty();
+
+	/**
+	 * @brief Bitmap word holding the dirty bit of the page at addr
+	 * (see dirtyBit()); addr must lie within a page of the memory
 	 */
-	unsigned int initFromElf(std::string ifile, std::vector<int> flags_signatures);
+	std::atomic<uint64_t> * dirtyWord(uint32_t addr)
+	{
+		return &dirty[(addr >> (DIRTY_PAGE_BITS + 6)) - dirty_base];
+	}
+
+	/**
+	 * @brief Dirty bit of the page at addr in its bitmap word
+	 */
+	static uint64_t dirtyBit(uint32_t addr)
+	{
+		return 1ull << ((addr >> DIRTY_PAGE_BITS) & 63);
+	}
+
+	/**
+	 * @brief Mark the page holding addr as written
+	 */
+	void setDirty(uint32_t addr)
+	{
+		// test first: stores to dirty pages must not contend on the bitmap
+		std::atomic<uint64_t> & w = *dirtyWord(addr);
+		uint64_t bit = dirtyBit(addr);
+		if(!(w.load(std::memory_order_relaxed) & bit))
+			w.fetch_or(bit, std::memory_order_release);
+	}
+
+
+	private:
+	// allocate the buffer from its backend
+	void mapAnonymous(bool hugepage);
+	void mapFile(const MemBacking & backing);
+	void mapShm(const MemBacking & backing);
+
+	// give the buffer back to its backend
+	void release();
+
+	// pages of the buffer may be replaced by private file mappings
+	bool remappable = false;
+
+	// dirty page bitmap; word 0 holds the 64 pages from dirty_base * 64 on
+	std::unique_ptr<std::atomic<uint64_t>[]> dirty;
+	uint32_t dirty_base = 0;
+	size_t dirty_words = 0;
+
+	// byte-wise access for misaligned and out of bounds cases
+	uint64_t fetchBytes(uint32_t addr, uint32_t n);
+	void storeBytes(uint32_t addr, uint64_t value, uint32_t n);
 };
\ No newline at end of file
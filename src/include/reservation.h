@@ -0,0 +1,129 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+#include "util.h"
+
+/**
+ * @brief LR/SC reservations of all harts
+ * Reservations cover a cache line of guest memory. The table is hashed by
+ * line, one slot per host cache line, so harts spinning on different locks
+ * do not share state. A slot holds the reserved line and the set of harts
+ * holding a reservation on it; claiming, checking and dropping reservations
+ * are single atomic operations on its slot, without any lock. An lr only adds
+ * its hart to the set, so harts contending on one lock do not cancel each
+ * other's reservations: the first sc to succeed (or any store) empties the
+ * slot. Two lines hashing to the same slot steal each other's reservations,
+ * which only makes an SC fail spuriously.
+ * Stores have to look up the slot of their line; until the first lr they
+ * skip that on a flag that is written once, so it is never contended.
+ */
+class ReservationTable
+{
+    public:
+    static const uint32_t LINE_BITS = 6;
+    static const uint32_t SLOTS = 1024;    // power of 2
+
+    // harts per slot; harts whose ids are equal modulo HART_BITS share a bit
+    // (and so the reservation) when they reserve the same line
+    static const uint32_t HART_BITS = 32 + LINE_BITS;
+    static_assert(HART_BITS + (32 - LINE_BITS) == 64, "line and harts fill a slot");
+
+    /**
+     * @brief Reserve the line holding addr for a hart (lr)
+     *
+     * @param hart reservation owner (unique per hart)
+     * @param addr guest address
+     */
+    void reserve(uint32_t hart, uint32_t addr)
+    {
+        if(UNLIKELY(!in_use.load(std::memory_order_relaxed)))
+            in_use.store(true);
+        std::atomic<uint64_t> & s = slot(addr);
+        uint64_t v = s.load(std::memory_order_relaxed);
+        uint64_t t;
+        do
+        {
+            // join the harts reserving the line, or evict another line
+            t = (reserved_line(v) == line(addr) ? v : (uint64_t)line(addr) << HART_BITS) | hart_bit(hart);
+        } while(!s.compare_exchange_weak(v, t));
+    }
+
+    /**
+     * @brief Claim the hart's reservation of the line holding addr (sc)
+     * Succeeding drops the reservations of all harts on the line, as the
+     * store of the sc would, so only one of them can succeed.
+     *
+     * @param hart reservation owner
+     * @param addr guest address
+     * @return true if the reservation was still held
+     */
+    bool release(uint32_t hart, uint32_t addr)
+    {
+        std::atomic<uint64_t> & s = slot(addr);
+        uint64_t v = s.load(std::memory_order_relaxed);
+        do
+        {
+            if(reserved_line(v) != line(addr) || !(v & hart_bit(hart)))
+                return false;
+        } while(!s.compare_exchange_weak(v, 0));
+        return true;
+    }
+
+    /**
+     * @brief Account a store: drops any reservation of the line holding addr
+     * (call after the store is performed)
+     *
+     * @param addr guest address
+     * @param len access size in bytes
+     */
+    void invalidate(uint32_t addr, uint32_t len)
+    {
+        if(LIKELY(!in_use.load(std::memory_order_relaxed)))
+            return;
+        _invalidate(addr);
+        if(UNLIKELY(((addr ^ (addr + len - 1)) >> LINE_BITS) != 0))
+            _invalidate(addr + len - 1);
+    }
+
+    private:
+    struct alignas(RVSIM_CACHE_LINE) Slot
+    {
+        std::atomic<uint64_t> v{0};
+    };
+    Slot slots[SLOTS];
+
+    // set by the first reservation
+    alignas(RVSIM_CACHE_LINE) std::atomic<bool> in_use{false};
+
+    std::atomic<uint64_t> & slot(uint32_t addr)
+    {
+        uint32_t l = line(addr);
+        return slots[(l ^ (l >> 10)) & (SLOTS-1)].v;
+    }
+
+    // reserved line in the upper bits, one bit per hart in the lower
+    // HART_BITS (no hart bits: free)
+    static uint32_t line(uint32_t addr)
+    {
+        return addr >> LINE_BITS;
+    }
+
+    static uint64_t reserved_line(uint64_t v)
+    {
+        return v >> HART_BITS;
+    }
+
+    static uint64_t hart_bit(uint32_t hart)
+    {
+        return 1ull << (hart % HART_BITS);
+    }
+
+    void _invalidate(uint32_t addr)
+    {
+        std::atomic<uint64_t> & s = slot(addr);
+        uint64_t v = s.load(std::memory_order_relaxed);
+        if(v && reserved_line(v) == line(addr))
+            s.compare_exchange_strong(v, 0);
+    }
+};
@@ -1,3 +1,78 @@
 #pragma once
 
-#define RV_INSTR_NOP 0x00000013
\ No newline at end of file
+#define RV_INSTR_NOP 0x00000013
+
+// Major opcodes : inst[6:0]
+#define RV_OPCODE_LOAD      0x03
+#define RV_OPCODE_MISC_MEM  0x0f
+#define RV_OPCODE_AMO       0x2f
+#define RV_OPCODE_OP_IMM    0x13
+#define RV_OPCODE_AUIPC     0x17
+#define RV_OPCODE_STORE     0x23
+#define RV_OPCODE_OP        0x33
+#define RV_OPCODE_LUI       0x37
+#define RV_OPCODE_BRANCH    0x63
+#define RV_OPCODE_JALR      0x67
+#define RV_OPCODE_JAL       0x6f
+#define RV_OPCODE_SYSTEM    0x73
+
+// Instruction fields
+#define RV_OPCODE(x)    ((x) & 0x7f)
+#define RV_RD(x)        (((x) >> 7) & 0x1f)
+#define RV_FUNCT3(x)    (((x) >> 12) & 0x07)
+#define RV_RS1(x)       (((x) >> 15) & 0x1f)
+#define RV_RS2(x)       (((x) >> 20) & 0x1f)
+#define RV_FUNCT7(x)    (((x) >> 25) & 0x7f)
+
+// Immediates (sign extended)
+#define RV_IMM_I(x)     ((int32_t)(x) >> 20)
+#define RV_IMM_S(x)     ((((int32_t)(x) >> 20) & ~0x1f) | (((x) >> 7) & 0x1f))
+#define RV_IMM_B(x)     ((((int32_t)(x) >> 19) & ~0xfff) | (((x) << 4) & 0x800) | (((x) >> 20) & 0x7e0) | (((x) >> 7) & 0x1e))
+#define RV_IMM_U(x)     ((int32_t)((x) & 0xfffff000))
+#define RV_IMM_J(x)     ((((int32_t)(x) >> 11) & ~0xfffff) | ((x) & 0xff000) | (((x) >> 9) & 0x800) | (((x) >> 20) & 0x7fe))
+
+// FENCE predecessor/successor sets : imm[7:4] / imm[3:0]
+#define RV_FENCE_W      0x1
+#define RV_FENCE_R      0x2
+#define RV_FENCE_O      0x4
+#define RV_FENCE_I      0x8
+#define RV_FENCE_PRED(imm)  (((imm) >> 4) & 0xf)
+#define RV_FENCE_SUCC(imm)  ((imm) & 0xf)
+
+// Fence ordering earlier stores before later loads: the one ordering a TSO
+// host does not provide without a full barrier
+#define RV_FENCE_STORE_LOAD(imm)    ((RV_FENCE_PRED(imm) & (RV_FENCE_W | RV_FENCE_O)) && (RV_FENCE_SUCC(imm) & (RV_FENCE_R | RV_FENCE_I)))
+
+// Exception causes (mcause)
+#define RV_EXC_INSN_MISALIGNED      0
+#define RV_EXC_INSN_ACCESS          1
+#define RV_EXC_ILLEGAL_INSN         2
+#define RV_EXC_BREAKPOINT           3
+#define RV_EXC_LOAD_MISALIGNED      4
+#define RV_EXC_LOAD_ACCESS          5
+#define RV_EXC_STORE_MISALIGNED     6
+#define RV_EXC_STORE_ACCESS         7
+#define RV_EXC_ECALL_M              11
+
+// Machine mode CSRs
+#define RV_CSR_MSTATUS      0x300
+#define RV_CSR_MISA         0x301
+#define RV_CSR_MIE          0x304
+#define RV_CSR_MTVEC        0x305
+#define RV_CSR_MSCRATCH     0x340
+#define RV_CSR_MEPC         0x341
+#define RV_CSR_MCAUSE       0x342
+#define RV_CSR_MTVAL        0x343
+#define RV_CSR_MIP          0x344
+#define RV_CSR_MVENDORID    0xf11
+#define RV_CSR_MARCHID      0xf12
+#define RV_CSR_MIMPID       0xf13
+#define RV_CSR_MHARTID      0xf14
+
+// CSRs with address bits [11:10] set are read-only
+#define RV_CSR_READ_ONLY(csr)   (((csr) >> 10) == 0x3)
+
+// mstatus fields (machine mode only: MPP always reads as M)
+#define RV_MSTATUS_MIE      (1u << 3)
+#define RV_MSTATUS_MPIE     (1u << 7)
+#define RV_MSTATUS_MPP      (3u << 11)
@@ -0,0 +1,203 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "rvdefs.h"
+#include "core.h"
+#include "decode.h"
+
+// Use labels-as-values for dispatch where available, engines fall back to a
+// plain switch otherwise
+#if defined(__GNUC__) && !defined(RVSIM_NO_COMPUTED_GOTO)
+#   define RVSIM_COMPUTED_GOTO
+#endif
+
+/**
+ * @brief Instruction semantics
+ * One handler per RVOp, each handler executes the instruction on the given
+ * core and leaves pc pointing to the next instruction to execute. Handlers
+ * that trap (RVCore::_trap()) return right away, without writing rd.
+ */
+struct RVExec
+{
+    #define RS1 (c.reg_file[d.rs1])
+    #define RS2 (c.reg_file[d.rs2])
+    #define WRD(v) (c.reg_file[d.rd] = (v))
+    #define NEXT() (c.pc += 4)
+    #define TRAPPED() UNLIKELY(c.trapped)
+
+    // Control transfers to targets that are not word aligned trap on the jump
+    static inline bool jump_misaligned(RVCore & c, uint32_t target)
+    {
+        if(LIKELY(!(target & 0x3)))
+            return false;
+        c._trap(RV_EXC_INSN_MISALIGNED, target);
+        return true;
+    }
+    #define BRANCH(cond)                                                    \
+        uint32_t off = (cond) ? d.imm : 4;                                  \
+        if(jump_misaligned(c, c.pc + off))                                  \
+            return;                                                         \
+        c.pc += off;
+
+    static void UNDECODED(RVCore & c, const DecodedInsn & d);
+    static inline void BLOCK_END(RVCore & c, const DecodedInsn & d) {}
+    static void ILLEGAL(RVCore & c, const DecodedInsn & d);
+
+    // Upper immediates & jumps
+    static inline void LUI(RVCore & c, const DecodedInsn & d)     { WRD(d.imm); NEXT(); }
+    static inline void AUIPC(RVCore & c, const DecodedInsn & d)   { WRD(c.pc + d.imm); NEXT(); }
+    static inline void JAL(RVCore & c, const DecodedInsn & d)
+    {
+        if(jump_misaligned(c, c.pc + d.imm))
+            return;
+        WRD(c.pc + 4);
+        c.pc += d.imm;
+    }
+    static inline void JALR(RVCore & c, const DecodedInsn & d)
+    {
+        uint32_t target = (RS1 + d.imm) & ~1u;
+        if(jump_misaligned(c, target))
+            return;
+        WRD(c.pc + 4);
+        c.pc = target;
+    }
+
+    // Branches
+    static inline void BEQ(RVCore & c, const DecodedInsn & d)     { BRANCH(RS1 == RS2); }
+    static inline void BNE(RVCore & c, const DecodedInsn & d)     { BRANCH(RS1 != RS2); }
+    static inline void BLT(RVCore & c, const DecodedInsn & d)     { BRANCH((int32_t)RS1 < (int32_t)RS2); }
+    static inline void BGE(RVCore & c, const DecodedInsn & d)     { BRANCH((int32_t)RS1 >= (int32_t)RS2); }
+    static inline void BLTU(RVCore & c, const DecodedInsn & d)    { BRANCH(RS1 < RS2); }
+    static inline void BGEU(RVCore & c, const DecodedInsn & d)    { BRANCH(RS1 >= RS2); }
+
+    // Loads
+    static inline void LB(RVCore & c, const DecodedInsn & d)      { uint32_t v = c._load(RS1 + d.imm, 1); if(TRAPPED()) return; WRD((int32_t)(int8_t)v); NEXT(); }
+    static inline void LH(RVCore & c, const DecodedInsn & d)      { uint32_t v = c._load(RS1 + d.imm, 2); if(TRAPPED()) return; WRD((int32_t)(int16_t)v); NEXT(); }
+    static inline void LW(RVCore & c, const DecodedInsn & d)      { uint32_t v = c._load(RS1 + d.imm, 4); if(TRAPPED()) return; WRD(v); NEXT(); }
+    static inline void LBU(RVCore & c, const DecodedInsn & d)     { uint32_t v = c._load(RS1 + d.imm, 1); if(TRAPPED()) return; WRD(v); NEXT(); }
+    static inline void LHU(RVCore & c, const DecodedInsn & d)     { uint32_t v = c._load(RS1 + d.imm, 2); if(TRAPPED()) return; WRD(v); NEXT(); }
+
+    // Stores
+    static inline void SB(RVCore & c, const DecodedInsn & d)      { c._store(RS1 + d.imm, 1, RS2); if(TRAPPED()) return; NEXT(); }
+    static inline void SH(RVCore & c, const DecodedInsn & d)      { c._store(RS1 + d.imm, 2, RS2); if(TRAPPED()) return; NEXT(); }
+    static inline void SW(RVCore & c, const DecodedInsn & d)      { c._store(RS1 + d.imm, 4, RS2); if(TRAPPED()) return; NEXT(); }
+
+    // Register-Immediate
+    static inline void ADDI(RVCore & c, const DecodedInsn & d)    { WRD(RS1 + d.imm); NEXT(); }
+    static inline void SLTI(RVCore & c, const DecodedInsn & d)    { WRD((int32_t)RS1 < d.imm); NEXT(); }
+    static inline void SLTIU(RVCore & c, const DecodedInsn & d)   { WRD(RS1 < (uint32_t)d.imm); NEXT(); }
+    static inline void XORI(RVCore & c, const DecodedInsn & d)    { WRD(RS1 ^ d.imm); NEXT(); }
+    static inline void ORI(RVCore & c, const DecodedInsn & d)     { WRD(RS1 | d.imm); NEXT(); }
+    static inline void ANDI(RVCore & c, const DecodedInsn & d)    { WRD(RS1 & d.imm); NEXT(); }
+    static inline void SLLI(RVCore & c, const DecodedInsn & d)    { WRD(RS1 << d.imm); NEXT(); }
+    static inline void SRLI(RVCore & c, const DecodedInsn & d)    { WRD(RS1 >> d.imm); NEXT(); }
+    static inline void SRAI(RVCore & c, const DecodedInsn & d)    { WRD((int32_t)RS1 >> d.imm); NEXT(); }
+
+    // Register-Register
+    static inline void ADD(RVCore & c, const DecodedInsn & d)     { WRD(RS1 + RS2); NEXT(); }
+    static inline void SUB(RVCore & c, const DecodedInsn & d)     { WRD(RS1 - RS2); NEXT(); }
+    static inline void SLL(RVCore & c, const DecodedInsn & d)     { WRD(RS1 << (RS2 & 0x1f)); NEXT(); }
+    static inline void SLT(RVCore & c, const DecodedInsn & d)     { WRD((int32_t)RS1 < (int32_t)RS2); NEXT(); }
+    static inline void SLTU(RVCore & c, const DecodedInsn & d)    { WRD(RS1 < RS2); NEXT(); }
+    static inline void XOR(RVCore & c, const DecodedInsn & d)     { WRD(RS1 ^ RS2); NEXT(); }
+    static inline void SRL(RVCore & c, const DecodedInsn & d)     { WRD(RS1 >> (RS2 & 0x1f)); NEXT(); }
+    static inline void SRA(RVCore & c, const DecodedInsn & d)     { WRD((int32_t)RS1 >> (RS2 & 0x1f)); NEXT(); }
+    static inline void OR(RVCore & c, const DecodedInsn & d)      { WRD(RS1 | RS2); NEXT(); }
+    static inline void AND(RVCore & c, const DecodedInsn & d)     { WRD(RS1 & RS2); NEXT(); }
+
+    // Misc
+    static inline void FENCE(RVCore & c, const DecodedInsn & d)
+    {
+        // guest accesses are relaxed host atomics (see mem_load_atomic()), so
+        // fences map to host fences
+        if(RV_FENCE_STORE_LOAD(d.imm))
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        else
+            std::atomic_thread_fence(std::memory_order_acq_rel);
+        NEXT();
+    }
+    static void FENCE_I(RVCore & c, const DecodedInsn & d);
+    static void ECALL(RVCore & c, const DecodedInsn & d);
+    static void EBREAK(RVCore & c, const DecodedInsn & d);
+    static void MRET(RVCore & c, const DecodedInsn & d);
+
+    // Zicsr
+    static void CSRRW(RVCore & c, const DecodedInsn & d);
+    static void CSRRS(RVCore & c, const DecodedInsn & d);
+    static void CSRRC(RVCore & c, const DecodedInsn & d);
+    static void CSRRWI(RVCore & c, const DecodedInsn & d);
+    static void CSRRSI(RVCore & c, const DecodedInsn & d);
+    static void CSRRCI(RVCore & c, const DecodedInsn & d);
+
+    // M extension
+    static inline void MUL(RVCore & c, const DecodedInsn & d)     { WRD(RS1 * RS2); NEXT(); }
+    static inline void MULH(RVCore & c, const DecodedInsn & d)    { WRD((uint32_t)(((int64_t)(int32_t)RS1 * (int64_t)(int32_t)RS2) >> 32)); NEXT(); }
+    static inline void MULHSU(RVCore & c, const DecodedInsn & d)  { WRD((uint32_t)(((int64_t)(int32_t)RS1 * (int64_t)(uint64_t)RS2) >> 32)); NEXT(); }
+    static inline void MULHU(RVCore & c, const DecodedInsn & d)   { WRD((uint32_t)(((uint64_t)RS1 * (uint64_t)RS2) >> 32)); NEXT(); }
+    static inline void DIV(RVCore & c, const DecodedInsn & d)
+    {
+        int32_t a = RS1, b = RS2;
+        WRD((b == 0) ? -1 : (a == INT32_MIN && b == -1) ? a : a / b);
+        NEXT();
+    }
+    static inline void DIVU(RVCore & c, const DecodedInsn & d)    { WRD((RS2 == 0) ? 0xffffffff : RS1 / RS2); NEXT(); }
+    static inline void REM(RVCore & c, const DecodedInsn & d)
+    {
+        int32_t a = RS1, b = RS2;
+        WRD((b == 0) ? a : (a == INT32_MIN && b == -1) ? 0 : a % b);
+        NEXT();
+    }
+    static inline void REMU(RVCore & c, const DecodedInsn & d)    { WRD((RS2 == 0) ? RS1 : RS1 % RS2); NEXT(); }
+
+    // A extension
+    static void LR_W(RVCore & c, const DecodedInsn & d);
+    static void SC_W(RVCore & c, const DecodedInsn & d);
+    static void AMOSWAP_W(RVCore & c, const DecodedInsn & d);
+    static void AMOADD_W(RVCore & c, const DecodedInsn & d);
+    static void AMOXOR_W(RVCore & c, const DecodedInsn & d);
+    static void AMOAND_W(RVCore & c, const DecodedInsn & d);
+    static void AMOOR_W(RVCore & c, const DecodedInsn & d);
+    static void AMOMIN_W(RVCore & c, const DecodedInsn & d);
+    static void AMOMAX_W(RVCore & c, const DecodedInsn & d);
+    static void AMOMINU_W(RVCore & c, const DecodedInsn & d);
+    static void AMOMAXU_W(RVCore & c, const DecodedInsn & d);
+
+    // Fused pairs; d is the first record, the second one directly follows it
+    static inline void FUSE_LUI_ADDI(RVCore & c, const DecodedInsn & d)   { WRD(d.imm); c.pc += 8; }
+    static inline void FUSE_AUIPC_JALR(RVCore & c, const DecodedInsn & d)
+    {
+        const DecodedInsn & d1 = (&d)[1];
+        uint32_t base = c.pc + d.imm;
+        uint32_t target = (base + d1.imm) & ~1u;
+        WRD(base);
+        if(UNLIKELY(target & 0x3))
+        {
+            // the auipc completes, the jalr traps
+            c.pc += 4;
+            jump_misaligned(c, target);
+            return;
+        }
+        c.reg_file[d1.rd] = c.pc + 8;
+        c.pc = target;
+    }
+    static inline void FUSE_AUIPC_LW(RVCore & c, const DecodedInsn & d)
+    {
+        const DecodedInsn & d1 = (&d)[1];
+        uint32_t base = c.pc + d.imm;
+        WRD(base);
+        c.pc += 4;
+        uint32_t v = c._load(base + d1.imm, 4);
+        if(TRAPPED())
+            return;
+        c.reg_file[d1.rd] = v;
+        c.pc += 4;
+    }
+    static inline void FUSE_SLLI_SRLI(RVCore & c, const DecodedInsn & d)  { WRD((RS1 << d.imm) >> (&d)[1].imm); c.pc += 8; }
+
+    #undef RS1
+    #undef RS2
+    #undef WRD
+    #undef NEXT
+    #undef TRAPPED
+    #undef BRANCH
+};
@@ -0,0 +1,281 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include "decode.h"
+#include "memmap.h"
+#include "jit.h"
+
+/**
+ * @brief pc value that never matches a block exit (pc is always word aligned)
+ */
+#define TBLOCK_NO_EXIT 0x1
+
+// Block exit kinds (TBlock::exit_flags)
+#define TBLOCK_CALL     0x1     // ends in a call (link register rd): return address is pushed
+#define TBLOCK_RETURN   0x2     // ends in a return (jalr x0, 0(link register)): return address is popped
+#define TBLOCK_INDIRECT 0x4     // successor is only known at run time
+
+/**
+ * @brief Translated block
+ * Straight-line run of decoded instructions ending at the first control
+ * transfer (or at a page boundary), terminated by an OP_BLOCK_END record.
+ */
+struct TBlock
+{
+    // guest address of first instruction
+    uint32_t pc;
+
+    // number of guest instructions in block
+    uint32_t len;
+
+    // statically known successors: [0] taken / jump target, [1] fall-through
+    uint32_t exit_pc[2];
+
+    // chained successors, filled in on first transition through each exit
+    TBlock * link[2];
+
+    // TBLOCK_CALL / TBLOCK_RETURN / TBLOCK_INDIRECT
+    uint8_t exit_flags;
+
+    // block at the return address of a call, filled in on the first return
+    TBlock * ret_link;
+
+    // decoded body (len records + OP_BLOCK_END)
+    std::vector<DecodedInsn> insns;
+
+    // number of times the block was entered
+    uint32_t exec_count;
+
+    // native translation, nullptr until the block gets hot
+    NativeBlockFn native;
+};
+
+
+/**
+ * @brief Code translated ahead of execution (see RVCore::pretranslate())
+ * Built once per image and copied into every core: links, counters and
+ * native code are per core, the decoded instructions are not.
+ */
+struct Pretranslation
+{
+    // block engines: translated blocks and the page generation each was built at
+    std::vector<TBlock> blocks;
+    std::vector<uint32_t> gens;
+
+    // decode engines: predecoded instructions and their addresses
+    std::vector<uint32_t> pcs;
+    std::vector<DecodedInsn> insns;
+};
+
+
+/**
+ * @brief Translation cache
+ * Maps guest pc to translated blocks; the hash table is only consulted when
+ * a block exit is taken for the first time or for indirect jumps
+ */
+class BlockCache
+{
+    public:
+    /**
+     * @brief Maximum number of instructions in a block
+     */
+    static const uint32_t MAX_BLOCK_LEN = 64;
+
+    /**
+     * @brief Entries in the indirect target cache (power of 2)
+     */
+    static const uint32_t TARGET_CACHE_SIZE = 256;
+
+    BlockCache()
+    {
+        _clear_targets();
+    }
+
+    /**
+     * @brief Find block starting at pc
+     *
+     * @param pc guest pc
+     * @return TBlock* block, nullptr if not translated yet
+     */
+    TBlock * lookup(uint32_t pc)
+    {
+        std::unordered_map<uint32_t, std::unique_ptr<TBlock>>::iterator it = blocks.find(pc);
+        return (it == blocks.end()) ? nullptr : it->second.get();
+    }
+
+    /**
+     * @brief Find the target block of an indirect jump
+     * Direct-mapped target cache in front of the hash table
+     *
+     * @param pc guest pc
+     * @return TBlock* block, nullptr if not translated yet
+     */
+    TBlock * lookup_indirect(uint32_t pc)
+    {
+        TargetEntry & e = targets[(pc >> 2) & (TARGET_CACHE_SIZE-1)];
+        if(e.pc == pc)
+            return e.block;
+
+        TBlock * b = lookup(pc);
+        if(b)
+        {
+            e.pc = pc;
+            e.block = b;
+        }
+        return b;
+    }
+
+    /**
+     * @brief Add a block to cache
+     *
+     * @param b block
+     * @param gen memory map generation of the block's page before decoding
+     * @return TBlock* cached block
+     */
+    TBlock * insert(TBlock * b, uint32_t gen)
+    {
+        blocks[b->pc].reset(b);
+
+        // a page is as old as its oldest block
+        PageBlocks & p = pages[b->pc >> DecodeCache::PAGE_BITS];
+        if(p.pcs.empty())
+            p.gen = gen;
+        p.pcs.push_back(b->pc);
+        return b;
+    }
+
+    /**
+     * @brief Drop the blocks of all pages written since they were translated
+     * (must not be called while a block is executing)
+     *
+     * @param mem_map memory map
+     * @return true if blocks were dropped; links into them are cleared, but
+     * the caller has to drop its own references (return stack)
+     */
+    bool sync(MemMap & mem_map);
+
+    /**
+     * @brief Drop all blocks (and thereby all links between them)
+     */
+    void flush()
+    {
+        blocks.clear();
+        pages.clear();
+        _clear_targets();
+        flush_pending = false;
+    }
+
+    /**
+     * @brief Number of cached blocks
+     */
+    size_t size()
+    {
+        return blocks.size();
+    }
+
+    /**
+     * @brief Number of cached blocks that have native code
+     */
+    size_t native_count()
+    {
+        size_t n = 0;
+        for(std::unordered_map<uint32_t, std::unique_ptr<TBlock>>::iterator it = blocks.begin(); it != blocks.end(); it++)
+        {
+            if(it->second->native)
+                n++;
+        }
+        return n;
+    }
+
+    /**
+     * @brief set when a flush is requested while a block is executing;
+     * the block engine flushes at the next block boundary
+     */
+    bool flush_pending = false;
+
+    private:
+    std::unordered_map<uint32_t, std::unique_ptr<TBlock>> blocks;
+
+    // blocks by guest page (blocks never cross pages)
+    struct PageBlocks
+    {
+        uint32_t gen;
+        std::vector<uint32_t> pcs;
+    };
+    std::unordered_map<uint32_t, PageBlocks> pages;
+
+    struct TargetEntry
+    {
+        uint32_t pc;
+        TBlock * block;
+    };
+    TargetEntry targets[TARGET_CACHE_SIZE];
+
+    void _clear_targets()
+    {
+        for(uint32_t i=0; i<TARGET_CACHE_SIZE; i++)
+        {
+            targets[i].pc = TBLOCK_NO_EXIT;
+            targets[i].block = nullptr;
+        }
+    }
+};
+
+
+/**
+ * @brief Return address stack
+ * Calls push their return address together with the caller's ret_link slot,
+ * returns pop it; a matching entry yields the return block without a cache
+ * lookup. Overflow silently drops the oldest entries, so a mismatch just
+ * falls back to the indirect target cache.
+ */
+class ReturnStack
+{
+    public:
+    static const uint32_t DEPTH = 32;
+
+    struct Entry
+    {
+        uint32_t pc;
+        TBlock ** link;
+    };
+
+    ReturnStack()
+    {
+        clear();
+    }
+
+    void push(uint32_t pc, TBlock ** link)
+    {
+        top = (top + 1) & (DEPTH-1);
+        entries[top].pc = pc;
+        entries[top].link = link;
+    }
+
+    Entry pop()
+    {
+        Entry e = entries[top];
+        entries[top].pc = TBLOCK_NO_EXIT;
+        top = (top - 1) & (DEPTH-1);
+        return e;
+    }
+
+    /**
+     * @brief Drop all entries (links point into blocks, so on every flush)
+     */
+    void clear()
+    {
+        for(uint32_t i=0; i<DEPTH; i++)
+        {
+            entries[i].pc = TBLOCK_NO_EXIT;
+            entries[i].link = nullptr;
+        }
+        top = 0;
+    }
+
+    private:
+    Entry entries[DEPTH];
+    uint32_t top;
+};
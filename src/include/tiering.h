@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <unordered_map>
+#include "tcache.h"
+
+/**
+ * @brief Tiered execution policy
+ * Guest blocks start out interpreted (tier 0), are translated to threaded
+ * blocks once they ran threaded_threshold times (tier 1) and get native code
+ * once the translated block ran native_threshold times (tier 2).
+ */
+class TierManager
+{
+    public:
+    enum Tier
+    {
+        TIER_INTERP = 0,
+        TIER_THREADED,
+        TIER_NATIVE,
+        TIER_COUNT
+    };
+
+    static const uint32_t DEFAULT_THREADED_THRESHOLD = 2;
+    static const uint32_t DEFAULT_NATIVE_THRESHOLD = 16;
+
+    /**
+     * @brief Interpreted executions before translation (<=1: translate on first use)
+     */
+    uint32_t threaded_threshold = DEFAULT_THREADED_THRESHOLD;
+
+    /**
+     * @brief Translated executions before native translation (0: never)
+     */
+    uint32_t native_threshold = DEFAULT_NATIVE_THRESHOLD;
+
+    /**
+     * @brief Count an interpreted execution of the block at pc
+     *
+     * @param pc block start
+     * @return true if block should now be translated
+     */
+    bool promote_interp(uint32_t pc)
+    {
+        if(threaded_threshold <= 1)
+            return true;
+
+        std::unordered_map<uint32_t, uint32_t>::iterator it = interp_count.find(pc);
+        if(it == interp_count.end())
+        {
+            interp_count[pc] = 1;
+            return false;
+        }
+        if(++it->second < threaded_threshold)
+            return false;
+
+        interp_count.erase(it);
+        return true;
+    }
+
+    /**
+     * @brief Count an execution of a translated block
+     *
+     * @param b block
+     * @return true if block should now get native code
+     */
+    bool promote_threaded(TBlock * b)
+    {
+        return native_threshold && ++b->exec_count >= native_threshold;
+    }
+
+    /**
+     * @brief Number of blocks seen so far that are still interpreted
+     */
+    size_t interp_blocks()
+    {
+        return interp_count.size();
+    }
+
+    private:
+    // execution counts of blocks in tier 0
+    std::unordered_map<uint32_t, uint32_t> interp_count;
+};
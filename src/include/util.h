@@ -11,6 +11,19 @@
 #   define DBG(x)
 #endif
 
+#if defined(__GNUC__)
+#   define LIKELY(x)    __builtin_expect(!!(x), 1)
+#   define UNLIKELY(x)  __builtin_expect(!!(x), 0)
+#   define COLD         __attribute__((cold, noinline))
+#else
+#   define LIKELY(x)    (x)
+#   define UNLIKELY(x)  (x)
+#   define COLD
+#endif
+
+// Host cache line size
+#define RVSIM_CACHE_LINE 64
+
 #define DBG_PRINT(X) \
     DBG(std::cout << X << std::endl)
 
@@ -25,14 +38,6 @@ void throwWarning(const std::string msg);
 void throwSuccessMessage(std::string msg, bool exit = false);
 
 // =============================== FILE READER =====================================
-/**
- * @brief reads a binary file
- * 
- * @param memfile filepath
- * @return std::vector<char> contents
- */
-std::vector<char> fReadBin(std::string memfile);
-
 /**
  * @brief Reads a file and returns its contents
  * 
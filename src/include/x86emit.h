@@ -0,0 +1,159 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Minimal x86-64 instruction emitter
+ * Covers just the instructions the JIT needs; all operand sizes are 32-bit
+ * unless the method name says otherwise. Memory operands are [base + disp].
+ */
+class X86Emitter
+{
+    public:
+    enum Reg
+    {
+        RAX=0, RCX=1, RDX=2, RBX=3, RSP=4, RBP=5, RSI=6, RDI=7,
+        R8=8, R9=9, R10=10, R11=11, R12=12, R13=13, R14=14, R15=15
+    };
+
+    // /digit of the 0x81 / 0x83 immediate group
+    enum AluOp
+    {
+        ALU_ADD=0, ALU_OR=1, ALU_AND=4, ALU_SUB=5, ALU_XOR=6, ALU_CMP=7
+    };
+
+    // /digit of the 0xC1 / 0xD3 shift group
+    enum ShiftOp
+    {
+        SHIFT_SHL=4, SHIFT_SHR=5, SHIFT_SAR=7
+    };
+
+    // condition codes (setcc / cmovcc / jcc)
+    enum Cond
+    {
+        CC_B=0x2, CC_AE=0x3, CC_E=0x4, CC_NE=0x5, CC_L=0xc, CC_GE=0xd
+    };
+
+    X86Emitter(uint8_t * buf, size_t capacity):
+        buf(buf), cap(capacity), pos(0), overflow(false)
+    {}
+
+    /**
+     * @brief Number of bytes emitted
+     */
+    size_t size() { return pos; }
+
+    /**
+     * @brief true if the emitter ran out of buffer space
+     */
+    bool overflowed() { return overflow; }
+
+    uint8_t * start() { return buf; }
+    uint8_t * current() { return buf + pos; }
+
+    // Stack & control
+    void push(Reg r)                { rex(false, 0, 0, r); byte(0x50 | (r & 7)); }
+    void pop(Reg r)                 { rex(false, 0, 0, r); byte(0x58 | (r & 7)); }
+    void ret()                      { byte(0xc3); }
+    void call(Reg r)                { rex(false, 0, 0, r); byte(0xff); modrm_reg(2, r); }
+    void mfence()                   { byte(0x0f); byte(0xae); byte(0xf0); }
+
+    /**
+     * @brief jcc rel32, returns offset of the displacement for patching
+     */
+    size_t jcc(Cond cc)             { byte(0x0f); byte(0x80 | cc); size_t at = pos; dword(0); return at; }
+
+    /**
+     * @brief jmp rel32, returns offset of the displacement for patching
+     */
+    size_t jmp()                    { byte(0xe9); size_t at = pos; dword(0); return at; }
+
+    /**
+     * @brief Point a rel32 displacement emitted by jcc()/jmp() to the current position
+     */
+    void bind(size_t at)
+    {
+        if(at + 4 <= cap)
+        {
+            int32_t rel = (int32_t)(pos - (at + 4));
+            for(int i=0; i<4; i++)
+                buf[at+i] = (uint8_t)(rel >> (8*i));
+        }
+    }
+
+    // Moves
+    void mov(Reg dst, Reg src)                          { rex(false, src, 0, dst); byte(0x89); modrm_reg(src, dst); }
+    void mov64(Reg dst, Reg src)                        { rex(true, src, 0, dst); byte(0x89); modrm_reg(src, dst); }
+    void mov(Reg dst, uint32_t imm)                     { rex(false, 0, 0, dst); byte(0xb8 | (dst & 7)); dword(imm); }
+    void mov64(Reg dst, uint64_t imm)                   { rex(true, 0, 0, dst); byte(0xb8 | (dst & 7)); qword(imm); }
+    void load(Reg dst, Reg base, int32_t disp)          { rex(false, dst, 0, base); byte(0x8b); modrm_mem(dst, base, disp); }
+    void store(Reg base, int32_t disp, Reg src)         { rex(false, src, 0, base); byte(0x89); modrm_mem(src, base, disp); }
+    void store(Reg base, int32_t disp, uint32_t imm)    { rex(false, 0, 0, base); byte(0xc7); modrm_mem(0, base, disp); dword(imm); }
+
+    // ALU
+    void alu(AluOp op, Reg dst, int32_t imm)
+    {
+        rex(false, 0, 0, dst);
+        if(imm >= -128 && imm <= 127)
+        {
+            byte(0x83); modrm_reg(op, dst); byte((uint8_t)imm);
+        }
+        else
+        {
+            byte(0x81); modrm_reg(op, dst); dword((uint32_t)imm);
+        }
+    }
+    void alu(AluOp op, Reg dst, Reg base, int32_t disp) { rex(false, dst, 0, base); byte((op << 3) | 0x03); modrm_mem(dst, base, disp); }
+    void alu(AluOp op, Reg dst, Reg src)                { rex(false, dst, 0, src); byte((op << 3) | 0x03); modrm_reg(dst, src); }
+    void test(Reg dst, uint32_t imm)                    { rex(false, 0, 0, dst); byte(0xf7); modrm_reg(0, dst); dword(imm); }
+    void cmp8(Reg base, int32_t disp, uint8_t imm)      { rex(false, 0, 0, base); byte(0x80); modrm_mem(ALU_CMP, base, disp); byte(imm); }
+    void imul(Reg dst, Reg src)                         { rex(false, dst, 0, src); byte(0x0f); byte(0xaf); modrm_reg(dst, src); }
+    void shift(ShiftOp op, Reg dst, uint8_t amount)     { rex(false, 0, 0, dst); byte(0xc1); modrm_reg(op, dst); byte(amount); }
+    void shift_cl(ShiftOp op, Reg dst)                  { rex(false, 0, 0, dst); byte(0xd3); modrm_reg(op, dst); }
+
+    // Conditionals (dst/src limited to eax..ebx for setcc)
+    void setcc(Cond cc, Reg dst)                        { byte(0x0f); byte(0x90 | cc); modrm_reg(0, dst); }
+    void movzx8(Reg dst, Reg src)                       { byte(0x0f); byte(0xb6); modrm_reg(dst, src); }
+    void cmov(Cond cc, Reg dst, Reg src)                { rex(false, dst, 0, src); byte(0x0f); byte(0x40 | cc); modrm_reg(dst, src); }
+
+    private:
+    uint8_t * buf;
+    size_t cap;
+    size_t pos;
+    bool overflow;
+
+    void byte(uint8_t b)
+    {
+        if(pos < cap)
+            buf[pos++] = b;
+        else
+            overflow = true;
+    }
+    void dword(uint32_t d)  { for(int i=0; i<4; i++) byte((uint8_t)(d >> (8*i))); }
+    void qword(uint64_t q)  { for(int i=0; i<8; i++) byte((uint8_t)(q >> (8*i))); }
+
+    void rex(bool w, int reg, int index, int rm)
+    {
+        uint8_t r = 0x40 | (w ? 0x8 : 0) | ((reg & 8) ? 0x4 : 0) | ((index & 8) ? 0x2 : 0) | ((rm & 8) ? 0x1 : 0);
+        if(r != 0x40)
+            byte(r);
+    }
+
+    void modrm_reg(int reg, int rm)
+    {
+        byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void modrm_mem(int reg, int base, int32_t disp)
+    {
+        // rbp/r13 have no disp-less form, rsp/r12 need a SIB byte
+        uint8_t mod = (disp == 0 && (base & 7) != RBP) ? 0x00 : (disp >= -128 && disp <= 127) ? 0x40 : 0x80;
+        byte(mod | ((reg & 7) << 3) | (base & 7));
+        if((base & 7) == RSP)
+            byte(0x24);
+        if(mod == 0x40)
+            byte((uint8_t)disp);
+        else if(mod == 0x80)
+            dword((uint32_t)disp);
+    }
+};
@@ -0,0 +1,54 @@
+#include <stdint.h>
+#include <string>
+#include <cctype>
+
+#include "util.h"
+#include "isa.h"
+
+uint32_t rv_isa_parse(const std::string & isa_string)
+{
+    std::string isa;
+    for(size_t i=0; i<isa_string.length(); i++)
+        isa += (char) std::tolower(isa_string[i]);
+
+    if(isa.compare(0, 4, "rv32") != 0 || isa.length() < 5)
+    {
+        throwError("Invalid ISA string [" + isa_string + "]: expected rv32<extensions>", true);
+    }
+
+    uint32_t ext = 0;
+    size_t i = 4;
+    for(; i<isa.length() && isa[i] != '_'; i++)
+    {
+        switch(isa[i])
+        {
+            case 'i': ext |= RV_EXT_I; break;
+            case 'm': ext |= RV_EXT_M; break;
+            case 'a': ext |= RV_EXT_A; break;
+            case 'f': ext |= RV_EXT_F; break;
+            case 'd': ext |= RV_EXT_D; break;
+            case 'c': ext |= RV_EXT_C; break;
+            case 'g': ext |= RV_EXT_I | RV_EXT_M | RV_EXT_A | RV_EXT_F | RV_EXT_D; break;
+            default:
+                throwError("Invalid ISA string [" + isa_string + "]: unknown extension '" + isa[i] + "'", true);
+        }
+    }
+
+    // Multi-letter extensions
+    while(i < isa.length())
+    {
+        size_t next = isa.find('_', i+1);
+        std::string z = isa.substr(i+1, next == std::string::npos ? std::string::npos : next-i-1);
+        if(z != "zifencei" && z != "zicsr")
+        {
+            throwError("Unsupported ISA extension [" + z + "]", true);
+        }
+        i = (next == std::string::npos) ? isa.length() : next;
+    }
+
+    if(!(ext & RV_EXT_I))
+    {
+        throwError("Invalid ISA string [" + isa_string + "]: base integer ISA (I) required", true);
+    }
+    return ext;
+}
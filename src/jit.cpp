@@ -0,0 +1,449 @@
+#include <stdint.h>
+#include <vector>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "rvdefs.h"
+#include "core.h"
+#include "jit.h"
+#include "tcache.h"
+#include "x86emit.h"
+
+// =============================== CODE BUFFER =====================================
+CodeBuffer::CodeBuffer(size_t size):
+    base(nullptr),
+    size(size),
+    used(0)
+{
+    void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED)
+    {
+        throwWarning("JIT: unable to map executable memory, native translation disabled");
+        this->size = 0;
+        return;
+    }
+    base = (uint8_t *) p;
+}
+
+
+CodeBuffer::~CodeBuffer()
+{
+    if(base)
+    {
+        munmap(base, size);
+    }
+}
+
+
+// =============================== RUNTIME HELPERS =====================================
+// pc is only kept up to date for traps (see RVCore::_trap())
+uint32_t RVJit::load8(RVCore * c, uint32_t addr, uint32_t pc)    { c->pc = pc; return (int32_t)(int8_t)c->_load(addr, 1); }
+uint32_t RVJit::load8u(RVCore * c, uint32_t addr, uint32_t pc)   { c->pc = pc; return c->_load(addr, 1); }
+uint32_t RVJit::load16(RVCore * c, uint32_t addr, uint32_t pc)   { c->pc = pc; return (int32_t)(int16_t)c->_load(addr, 2); }
+uint32_t RVJit::load16u(RVCore * c, uint32_t addr, uint32_t pc)  { c->pc = pc; return c->_load(addr, 2); }
+uint32_t RVJit::load32(RVCore * c, uint32_t addr, uint32_t pc)   { c->pc = pc; return c->_load(addr, 4); }
+void RVJit::store8(RVCore * c, uint32_t addr, uint32_t value, uint32_t pc)  { c->pc = pc; c->_store(addr, 1, value); }
+void RVJit::store16(RVCore * c, uint32_t addr, uint32_t value, uint32_t pc) { c->pc = pc; c->_store(addr, 2, value); }
+void RVJit::store32(RVCore * c, uint32_t addr, uint32_t value, uint32_t pc) { c->pc = pc; c->_store(addr, 4, value); }
+
+
+uint32_t RVJit::exec_insn(RVCore * c, const DecodedInsn * d, uint32_t pc)
+{
+    // Instructions without a native translation go through the interpreter
+    c->pc = pc;
+    d->exec(*c, *d);
+    return c->pc;
+}
+
+
+uint32_t RVJit::jump_fault(RVCore * c, uint32_t target, uint32_t pc)
+{
+    c->pc = pc;
+    c->_trap(RV_EXC_INSN_MISALIGNED, target);
+    return c->pc;
+}
+
+
+// =============================== TRANSLATOR =====================================
+#if defined(__x86_64__)
+
+typedef X86Emitter E;
+
+// Register allocation: guest registers live in memory (regs array), rbx points
+// to it, r12 holds the core; eax/ecx/edx/esi/edi are scratch.
+static const E::Reg REGS = E::RBX;
+static const E::Reg CORE = E::R12;
+
+// regs[] holds x0..x31 and the x0 write sink
+static inline int32_t reg_disp(uint8_t r)
+{
+    return 4 * r;
+}
+
+static void load_reg(E & e, E::Reg dst, uint8_t r)
+{
+    if(r == 0)
+        e.mov(dst, (uint32_t)0);
+    else
+        e.load(dst, REGS, reg_disp(r));
+}
+
+static void store_reg(E & e, uint8_t r, E::Reg src)
+{
+    if(r != RV_REG_SINK)
+        e.store(REGS, reg_disp(r), src);
+}
+
+static void call_helper(E & e, const void * fn)
+{
+    e.mov64(E::RAX, (uint64_t)(uintptr_t)fn);
+    e.call(E::RAX);
+}
+
+// Leave native code; next pc is in eax
+static void emit_exit(E & e)
+{
+    e.pop(E::RBP);
+    e.pop(E::R12);
+    e.pop(E::RBX);
+    e.ret();
+}
+
+// Exits taken when an instruction traps; emitted out of line after the block
+struct TrapExits
+{
+    int32_t trapped_disp;               // RVCore::trapped relative to the core
+    int32_t pc_disp;                    // RVCore::pc relative to the core
+    std::vector<size_t> trapped;        // jcc taken when the core trapped
+    std::vector<std::pair<size_t, uint32_t>> misaligned;  // jalr to a misaligned target (jcc, pc)
+};
+
+// Leave the block if the helper just called raised a trap
+static void emit_trap_check(E & e, TrapExits & t)
+{
+    e.cmp8(CORE, t.trapped_disp, 0);
+    t.trapped.push_back(e.jcc(E::CC_NE));
+}
+
+static void emit_trap_exits(E & e, TrapExits & t)
+{
+    // the trap left the handler address in pc
+    if(!t.trapped.empty())
+    {
+        for(size_t i=0; i<t.trapped.size(); i++)
+            e.bind(t.trapped[i]);
+        e.load(E::RAX, CORE, t.pc_disp);
+        emit_exit(e);
+    }
+
+    for(size_t i=0; i<t.misaligned.size(); i++)
+    {
+        e.bind(t.misaligned[i].first);
+        e.mov(E::RSI, E::RAX);
+        e.mov64(E::RDI, CORE);
+        e.mov(E::RDX, t.misaligned[i].second);
+        call_helper(e, (const void *)&RVJit::jump_fault);
+        emit_exit(e);
+    }
+}
+
+static void emit_load(E & e, const DecodedInsn & d, const void * helper, uint32_t pc, TrapExits & t)
+{
+    e.mov64(E::RDI, CORE);
+    load_reg(e, E::RSI, d.rs1);
+    if(d.imm)
+        e.alu(E::ALU_ADD, E::RSI, d.imm);
+    e.mov(E::RDX, pc);
+    call_helper(e, helper);
+    emit_trap_check(e, t);
+    store_reg(e, d.rd, E::RAX);
+}
+
+static void emit_store(E & e, const DecodedInsn & d, const void * helper, uint32_t pc, TrapExits & t)
+{
+    e.mov64(E::RDI, CORE);
+    load_reg(e, E::RSI, d.rs1);
+    if(d.imm)
+        e.alu(E::ALU_ADD, E::RSI, d.imm);
+    load_reg(e, E::RDX, d.rs2);
+    e.mov(E::RCX, pc);
+    call_helper(e, helper);
+    emit_trap_check(e, t);
+}
+
+// Run an instruction through its interpreter handler; returns true if it
+// ends the block (eax holds the next pc then)
+static bool emit_exec_insn(E & e, const DecodedInsn & d, uint32_t pc, TrapExits & t)
+{
+    e.mov64(E::RDI, CORE);
+    e.mov64(E::RSI, (uint64_t)(uintptr_t)&d);
+    e.mov(E::RDX, pc);
+    call_helper(e, (const void *)&RVJit::exec_insn);
+    if(op_ends_block(d.op))
+        return true;
+    if(op_may_trap(d.op))
+        emit_trap_check(e, t);
+    return false;
+}
+
+static void emit_alu_imm(E & e, const DecodedInsn & d, E::AluOp op)
+{
+    if(d.rd == RV_REG_SINK)
+        return;
+    load_reg(e, E::RAX, d.rs1);
+    e.alu(op, E::RAX, d.imm);
+    store_reg(e, d.rd, E::RAX);
+}
+
+static void emit_alu_reg(E & e, const DecodedInsn & d, E::AluOp op)
+{
+    if(d.rd == RV_REG_SINK)
+        return;
+    load_reg(e, E::RAX, d.rs1);
+    load_reg(e, E::RCX, d.rs2);
+    e.alu(op, E::RAX, E::RCX);
+    store_reg(e, d.rd, E::RAX);
+}
+
+static void emit_shift_imm(E & e, const DecodedInsn & d, E::ShiftOp op)
+{
+    if(d.rd == RV_REG_SINK)
+        return;
+    load_reg(e, E::RAX, d.rs1);
+    e.shift(op, E::RAX, (uint8_t)d.imm);
+    store_reg(e, d.rd, E::RAX);
+}
+
+static void emit_shift_reg(E & e, const DecodedInsn & d, E::ShiftOp op)
+{
+    if(d.rd == RV_REG_SINK)
+        return;
+    load_reg(e, E::RAX, d.rs1);
+    load_reg(e, E::RCX, d.rs2);
+    e.shift_cl(op, E::RAX);
+    store_reg(e, d.rd, E::RAX);
+}
+
+// rd = (rs1 <cc> rs2/imm) ? 1 : 0
+static void emit_set(E & e, const DecodedInsn & d, E::Cond cc, bool imm)
+{
+    if(d.rd == RV_REG_SINK)
+        return;
+    load_reg(e, E::RAX, d.rs1);
+    if(imm)
+    {
+        e.alu(E::ALU_CMP, E::RAX, d.imm);
+    }
+    else
+    {
+        load_reg(e, E::RCX, d.rs2);
+        e.alu(E::ALU_CMP, E::RAX, E::RCX);
+    }
+    e.setcc(cc, E::RAX);
+    e.movzx8(E::RAX, E::RAX);
+    store_reg(e, d.rd, E::RAX);
+}
+
+// eax = (rs1 <cc> rs2) ? taken : not_taken
+static void emit_branch(E & e, const DecodedInsn & d, E::Cond cc, uint32_t pc)
+{
+    load_reg(e, E::RAX, d.rs1);
+    load_reg(e, E::RCX, d.rs2);
+    e.alu(E::ALU_CMP, E::RAX, E::RCX);
+    e.mov(E::RAX, pc + 4);
+    e.mov(E::RCX, pc + d.imm);
+    e.cmov(cc, E::RAX, E::RCX);
+}
+
+
+// jal, branches and auipc+jalr whose (static) target is not word aligned
+static bool static_target_misaligned(const TBlock * b, uint32_t i)
+{
+    const DecodedInsn & d = b->insns[i];
+    switch(d.op)
+    {
+        case OP_JAL:
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+            return (d.imm & 0x3) != 0;
+        case OP_FUSE_AUIPC_JALR:
+            return ((b->pc + 4*i + d.imm + b->insns[i+1].imm) & 0x2) != 0;
+        default:
+            return false;
+    }
+}
+
+
+bool RVJit::available()
+{
+    return true;
+}
+
+
+NativeBlockFn RVJit::compile(RVCore * c, TBlock * b, CodeBuffer & buf)
+{
+    if(!buf.valid())
+        return nullptr;
+
+    E e(buf.free_ptr(), buf.free_space());
+    TrapExits traps;
+    traps.trapped_disp = (int32_t)((uint8_t *)&c->trapped - (uint8_t *)c);
+    traps.pc_disp = (int32_t)((uint8_t *)&c->pc - (uint8_t *)c);
+
+    // Prologue: 3 pushes keep the stack 16 byte aligned for helper calls
+    e.push(E::RBX);
+    e.push(E::R12);
+    e.push(E::RBP);
+    e.mov64(REGS, E::RDI);
+    e.mov64(CORE, E::RSI);
+
+    bool exited = false;
+    for(uint32_t i=0; i<b->len && !exited; i += op_records(b->insns[i].op))
+    {
+        const DecodedInsn & d = b->insns[i];
+        uint32_t pc = b->pc + 4*i;
+
+        // jumps that trap on their static target are left to the interpreter
+        if(static_target_misaligned(b, i))
+        {
+            exited = emit_exec_insn(e, d, pc, traps);
+            continue;
+        }
+
+        switch(d.op)
+        {
+            case OP_LUI:    if(d.rd != RV_REG_SINK) e.store(REGS, reg_disp(d.rd), (uint32_t)d.imm); break;
+            case OP_AUIPC:  if(d.rd != RV_REG_SINK) e.store(REGS, reg_disp(d.rd), (uint32_t)(pc + d.imm)); break;
+
+            case OP_ADDI:   emit_alu_imm(e, d, E::ALU_ADD); break;
+            case OP_XORI:   emit_alu_imm(e, d, E::ALU_XOR); break;
+            case OP_ORI:    emit_alu_imm(e, d, E::ALU_OR); break;
+            case OP_ANDI:   emit_alu_imm(e, d, E::ALU_AND); break;
+            case OP_SLTI:   emit_set(e, d, E::CC_L, true); break;
+            case OP_SLTIU:  emit_set(e, d, E::CC_B, true); break;
+            case OP_SLLI:   emit_shift_imm(e, d, E::SHIFT_SHL); break;
+            case OP_SRLI:   emit_shift_imm(e, d, E::SHIFT_SHR); break;
+            case OP_SRAI:   emit_shift_imm(e, d, E::SHIFT_SAR); break;
+
+            case OP_ADD:    emit_alu_reg(e, d, E::ALU_ADD); break;
+            case OP_SUB:    emit_alu_reg(e, d, E::ALU_SUB); break;
+            case OP_XOR:    emit_alu_reg(e, d, E::ALU_XOR); break;
+            case OP_OR:     emit_alu_reg(e, d, E::ALU_OR); break;
+            case OP_AND:    emit_alu_reg(e, d, E::ALU_AND); break;
+            case OP_SLT:    emit_set(e, d, E::CC_L, false); break;
+            case OP_SLTU:   emit_set(e, d, E::CC_B, false); break;
+            case OP_SLL:    emit_shift_reg(e, d, E::SHIFT_SHL); break;
+            case OP_SRL:    emit_shift_reg(e, d, E::SHIFT_SHR); break;
+            case OP_SRA:    emit_shift_reg(e, d, E::SHIFT_SAR); break;
+
+            case OP_LB:     emit_load(e, d, (const void *)&RVJit::load8, pc, traps); break;
+            case OP_LBU:    emit_load(e, d, (const void *)&RVJit::load8u, pc, traps); break;
+            case OP_LH:     emit_load(e, d, (const void *)&RVJit::load16, pc, traps); break;
+            case OP_LHU:    emit_load(e, d, (const void *)&RVJit::load16u, pc, traps); break;
+            case OP_LW:     emit_load(e, d, (const void *)&RVJit::load32, pc, traps); break;
+            case OP_SB:     emit_store(e, d, (const void *)&RVJit::store8, pc, traps); break;
+            case OP_SH:     emit_store(e, d, (const void *)&RVJit::store16, pc, traps); break;
+            case OP_SW:     emit_store(e, d, (const void *)&RVJit::store32, pc, traps); break;
+
+            case OP_MUL:
+                if(d.rd == RV_REG_SINK)
+                    break;
+                load_reg(e, E::RAX, d.rs1);
+                load_reg(e, E::RCX, d.rs2);
+                e.imul(E::RAX, E::RCX);
+                store_reg(e, d.rd, E::RAX);
+                break;
+
+            case OP_FENCE:
+                // x86 is TSO: only store->load ordering needs a barrier
+                if(RV_FENCE_STORE_LOAD(d.imm))
+                    e.mfence();
+                break;
+
+            // Fused pairs (second record at i+1)
+            case OP_FUSE_LUI_ADDI:
+                e.store(REGS, reg_disp(d.rd), (uint32_t)d.imm);
+                break;
+
+            case OP_FUSE_SLLI_SRLI:
+                load_reg(e, E::RAX, d.rs1);
+                e.shift(E::SHIFT_SHL, E::RAX, (uint8_t)d.imm);
+                e.shift(E::SHIFT_SHR, E::RAX, (uint8_t)b->insns[i+1].imm);
+                store_reg(e, d.rd, E::RAX);
+                break;
+
+            case OP_FUSE_AUIPC_LW:
+                e.store(REGS, reg_disp(d.rd), (uint32_t)(pc + d.imm));
+                e.mov64(E::RDI, CORE);
+                e.mov(E::RSI, (uint32_t)(pc + d.imm + b->insns[i+1].imm));
+                e.mov(E::RDX, pc + 4);
+                call_helper(e, (const void *)&RVJit::load32);
+                emit_trap_check(e, traps);
+                store_reg(e, b->insns[i+1].rd, E::RAX);
+                break;
+
+            case OP_FUSE_AUIPC_JALR:
+                e.store(REGS, reg_disp(d.rd), (uint32_t)(pc + d.imm));
+                if(b->insns[i+1].rd != RV_REG_SINK) e.store(REGS, reg_disp(b->insns[i+1].rd), pc + 8);
+                e.mov(E::RAX, (uint32_t)(pc + d.imm + b->insns[i+1].imm) & ~1u);
+                exited = true;
+                break;
+
+            case OP_BEQ:    emit_branch(e, d, E::CC_E, pc); exited = true; break;
+            case OP_BNE:    emit_branch(e, d, E::CC_NE, pc); exited = true; break;
+            case OP_BLT:    emit_branch(e, d, E::CC_L, pc); exited = true; break;
+            case OP_BGE:    emit_branch(e, d, E::CC_GE, pc); exited = true; break;
+            case OP_BLTU:   emit_branch(e, d, E::CC_B, pc); exited = true; break;
+            case OP_BGEU:   emit_branch(e, d, E::CC_AE, pc); exited = true; break;
+
+            case OP_JAL:
+                if(d.rd != RV_REG_SINK) e.store(REGS, reg_disp(d.rd), pc + 4);
+                e.mov(E::RAX, pc + d.imm);
+                exited = true;
+                break;
+
+            case OP_JALR:
+                load_reg(e, E::RAX, d.rs1);
+                if(d.imm)
+                    e.alu(E::ALU_ADD, E::RAX, d.imm);
+                e.alu(E::ALU_AND, E::RAX, -2);
+                e.test(E::RAX, 0x2);
+                traps.misaligned.push_back(std::make_pair(e.jcc(E::CC_NE), pc));
+                if(d.rd != RV_REG_SINK) e.store(REGS, reg_disp(d.rd), pc + 4);
+                exited = true;
+                break;
+
+            default:
+                // no native translation (mulh/div/rem, amo, csr, ecall, ebreak, mret, fence.i, illegal)
+                exited = emit_exec_insn(e, d, pc, traps);
+                break;
+        }
+    }
+
+    if(!exited)
+    {
+        e.mov(E::RAX, b->pc + 4*b->len);
+    }
+    emit_exit(e);
+    emit_trap_exits(e, traps);
+
+    if(e.overflowed())
+        return nullptr;
+
+    buf.commit(e.size());
+    return (NativeBlockFn) e.start();
+}
+
+#else
+
+bool RVJit::available()
+{
+    return false;
+}
+
+
+NativeBlockFn RVJit::compile(RVCore * c, TBlock * b, CodeBuffer & buf)
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,480 @@
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "elf_types.hpp"
+
+#include "defs.h"
+#include "util.h"
+#include "loader.h"
+
+extern SimArgs * cli_args;
+
+// Region holding addr and the number of bytes of [addr, addr+len) inside it
+static Memory * loader_region(MemMap & mem_map, uint32_t addr, uint64_t len, size_t & chunk)
+{
+    Memory * m = mem_map.region(addr, 1);
+    if(!m)
+    {
+        char errmsg[80];
+        sprintf(errmsg, "Image data @ 0x%08x is not in any memory region", addr);
+        throwError(errmsg, true);
+        return nullptr;
+    }
+    uint64_t end = (uint64_t)m->base_addr + m->size;
+    chunk = (size_t)std::min(len, end - addr);
+    return m;
+}
+
+
+// Copy file contents at offset to [addr, addr+len), region by region
+static void load_file_range(MemMap & mem_map, uint32_t addr, const char * data, uint64_t len, int fd, uint64_t offset)
+{
+    uint64_t off = 0;
+    while(off < len)
+    {
+        size_t chunk;
+        Memory * m = loader_region(mem_map, addr + off, len - off, chunk);
+        m->writeFromFile(addr + off, data + off, chunk, fd, offset + off, cli_args->lazy_load);
+        off += chunk;
+    }
+}
+
+
+// Read only mapping of a whole file
+struct MappedFile
+{
+    int fd = -1;
+    const char * data = nullptr;
+    size_t size = 0;
+
+    MappedFile(const std::string & file)
+    {
+        fd = open(file.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0)
+        {
+            throwError("Can't open input file : " + file, true);
+        }
+        size = st.st_size;
+        if(size)
+        {
+            void * p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p == MAP_FAILED)
+            {
+                throwError("Can't map input file : " + file, true);
+            }
+            data = (const char *)p;
+            madvise(p, size, MADV_SEQUENTIAL);
+        }
+    }
+
+    ~MappedFile()
+    {
+        if(data)
+            munmap((void *)data, size);
+        if(fd >= 0)
+            close(fd);
+    }
+};
+
+
+uint32_t load_elf(MemMap & mem_map, const std::string & file)
+{
+    // Only the ELF and program headers are parsed; segment data is taken
+    // from the mapping, so nothing is read before it is loaded (or paged in
+    // lazily) and read-only segments are mapped straight from the file
+    MappedFile f(file);
+    ELFIO::Elf32_Ehdr eh;
+    if(f.size < sizeof(eh))
+    {
+        throwError("Can't find or process ELF file : " + file, true);
+    }
+    memcpy(&eh, f.data, sizeof(eh));
+    if(eh.e_ident[EI_MAG0] != ELFMAG0 || eh.e_ident[EI_MAG1] != ELFMAG1 || eh.e_ident[EI_MAG2] != ELFMAG2 || eh.e_ident[EI_MAG3] != ELFMAG3)
+    {
+        throwError("Can't find or process ELF file : " + file, true);
+    }
+
+    // Check ELF Class, Endiness & machine
+    if(eh.e_ident[EI_CLASS] != ELFCLASS32)
+        throwError("Elf file format invalid: should be 32-bit elf", true);
+    if(eh.e_ident[EI_DATA] != ELFDATA2LSB)
+        throwError("Elf file format invalid: should be little Endian", true);
+    if(eh.e_machine != EM_RISCV)
+        throwError("Elf file format invalid: not a RISC-V executable", true);
+    if(eh.e_phnum && (eh.e_phentsize < sizeof(ELFIO::Elf32_Phdr) || (uint64_t)eh.e_phoff + (uint64_t)eh.e_phnum * eh.e_phentsize > f.size))
+        throwError("Elf file format invalid: bad program header table", true);
+
+    for(ELFIO::Elf_Half i=0; i<eh.e_phnum; i++)
+    {
+        ELFIO::Elf32_Phdr ph;
+        memcpy(&ph, f.data + eh.e_phoff + (size_t)i * eh.e_phentsize, sizeof(ph));
+        if(ph.p_type != PT_LOAD || ph.p_memsz == 0)
+            continue;
+
+        uint32_t addr = ph.p_paddr;
+        uint64_t filesz = ph.p_filesz;
+        uint64_t memsz = ph.p_memsz;
+        if(filesz > memsz || addr + memsz > (1ull << 32) || ph.p_offset + filesz > f.size)
+        {
+            char errmsg[80];
+            sprintf(errmsg, "Elf file format invalid: bad segment %u @ 0x%08x", i, addr);
+            throwError(errmsg, true);
+        }
+
+        if(cli_args->verbose_flag)
+            printf("Loading segment %u @ 0x%08x (file: %llu, mem: %llu bytes)\n", i, addr, (unsigned long long)filesz, (unsigned long long)memsz);
+
+        load_file_range(mem_map, addr, f.data + ph.p_offset, filesz, f.fd, ph.p_offset);
+
+        // bss
+        uint64_t off = filesz;
+        while(off < memsz)
+        {
+            size_t chunk;
+            Memory * m = loader_region(mem_map, addr + off, memsz - off, chunk);
+            m->zero(addr + off, chunk);
+            off += chunk;
+        }
+    }
+
+    return eh.e_entry;
+}
+
+
+std::vector<ElfSymbol> elf_symbols(const std::string & file)
+{
+    std::vector<ElfSymbol> symbols;
+
+    MappedFile f(file);
+    ELFIO::Elf32_Ehdr eh;
+    if(f.size < sizeof(eh))
+        return symbols;
+    memcpy(&eh, f.data, sizeof(eh));
+    if(eh.e_ident[EI_MAG0] != ELFMAG0 || eh.e_ident[EI_MAG1] != ELFMAG1 || eh.e_ident[EI_MAG2] != ELFMAG2 || eh.e_ident[EI_MAG3] != ELFMAG3 || eh.e_ident[EI_CLASS] != ELFCLASS32)
+        return symbols;
+    if(!eh.e_shnum || eh.e_shentsize < sizeof(ELFIO::Elf32_Shdr) || (uint64_t)eh.e_shoff + (uint64_t)eh.e_shnum * eh.e_shentsize > f.size)
+        return symbols;
+
+    auto section = [&](uint32_t i)
+    {
+        ELFIO::Elf32_Shdr sh;
+        memcpy(&sh, f.data + eh.e_shoff + (size_t)i * eh.e_shentsize, sizeof(sh));
+        return sh;
+    };
+
+    for(ELFIO::Elf_Half i=0; i<eh.e_shnum; i++)
+    {
+        ELFIO::Elf32_Shdr sh = section(i);
+        if(sh.sh_type != SHT_SYMTAB || sh.sh_entsize < sizeof(ELFIO::Elf32_Sym) || (uint64_t)sh.sh_offset + sh.sh_size > f.size || sh.sh_link >= eh.e_shnum)
+            continue;
+
+        // names are looked up in the linked string table
+        ELFIO::Elf32_Shdr strtab = section(sh.sh_link);
+        if((uint64_t)strtab.sh_offset + strtab.sh_size > f.size)
+            continue;
+        const char * strs = f.data + strtab.sh_offset;
+
+        for(uint32_t off=0; off + sh.sh_entsize <= sh.sh_size; off+=sh.sh_entsize)
+        {
+            ELFIO::Elf32_Sym sym;
+            memcpy(&sym, f.data + sh.sh_offset + off, sizeof(sym));
+
+            ElfSymbol s;
+            if(sym.st_name < strtab.sh_size)
+                s.name.assign(strs + sym.st_name, strnlen(strs + sym.st_name, strtab.sh_size - sym.st_name));
+            s.value = sym.st_value;
+            s.type = ELF_ST_TYPE(sym.st_info);
+            s.shndx = sym.st_shndx;
+            symbols.push_back(s);
+        }
+    }
+    return symbols;
+}
+
+
+uint32_t load_bin(MemMap & mem_map, const std::string & file, uint32_t base)
+{
+    MappedFile f(file);
+    if((uint64_t)base + f.size > (1ull << 32))
+    {
+        throwError("Binary file does not fit in the address space : " + file, true);
+    }
+
+    if(cli_args->verbose_flag)
+        printf("Loading binary @ 0x%08x (%zu bytes)\n", base, f.size);
+
+    load_file_range(mem_map, base, f.data, f.size, f.fd, 0);
+    return base;
+}
+
+
+// Stores decoded image bytes straight into guest memory
+class HexSink
+{
+    public:
+    HexSink(MemMap & mem_map) :
+        mem_map(mem_map)
+    {}
+
+    void put(uint32_t addr, const uint8_t * src, size_t len)
+    {
+        // records almost always land in the region of the previous one
+        if(!last || !last->isValidRange(addr, len))
+        {
+            last = mem_map.region(addr, len);
+            if(!last)
+            {
+                // record straddles regions (or is outside all of them)
+                for(size_t i=0; i<len; i++)
+                {
+                    size_t chunk;
+                    Memory * m = loader_region(mem_map, addr + i, 1, chunk);
+                    m->mem[m->global2local(addr + i)] = src[i];
+                    m->markDirty(addr + i, 1);
+                }
+                return;
+            }
+        }
+        memcpy(last->mem + last->global2local(addr), src, len);
+        last->markDirty(addr, len);
+    }
+
+    private:
+    MemMap & mem_map;
+    Memory * last = nullptr;
+};
+
+
+static inline int hex_digit(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+
+// Intel HEX: ':' len(2) addr(4) type(2) data(2*len) checksum(2)
+static uint32_t load_ihex(HexSink & sink, const MappedFile & f, const std::string & file, uint32_t base)
+{
+    const char * p = f.data;
+    const char * end = f.data + f.size;
+    uint32_t upper = 0;     // extended segment/linear address
+    uint32_t entry = base;
+    unsigned line = 1;
+
+    while(p < end)
+    {
+        if(*p == '\n')
+            line++;
+        if(*p != ':')
+        {
+            p++;
+            continue;
+        }
+        p++;
+
+        // decode the record in place
+        uint8_t rec[4 + 255 + 1];
+        size_t n = 0;
+        while(p + 1 < end && n < sizeof(rec))
+        {
+            int hi = hex_digit(p[0]);
+            int lo = hex_digit(p[1]);
+            if(hi < 0 || lo < 0)
+                break;
+            rec[n++] = (uint8_t)(hi << 4 | lo);
+            p += 2;
+        }
+
+        uint8_t sum = 0;
+        for(size_t i=0; i<n; i++)
+            sum += rec[i];
+        if(n < 5 || n != 5 + (size_t)rec[0] || sum != 0)
+        {
+            throwError("Invalid Intel HEX record in " + file + " at line " + std::to_string(line), true);
+        }
+
+        uint8_t len = rec[0];
+        uint32_t offset = (uint32_t)rec[1] << 8 | rec[2];
+        const uint8_t * data = rec + 4;
+        if(((rec[3] == 0x02 || rec[3] == 0x04) && len != 2) || ((rec[3] == 0x03 || rec[3] == 0x05) && len != 4))
+        {
+            throwError("Invalid Intel HEX record length in " + file + " at line " + std::to_string(line), true);
+        }
+        switch(rec[3])
+        {
+            case 0x00:  // data
+                sink.put(base + upper + offset, data, len);
+                break;
+            case 0x01:  // end of file
+                return entry;
+            case 0x02:  // extended segment address
+                upper = ((uint32_t)data[0] << 8 | data[1]) << 4;
+                break;
+            case 0x04:  // extended linear address
+                upper = ((uint32_t)data[0] << 8 | data[1]) << 16;
+                break;
+            case 0x03:  // start segment address (CS:IP)
+                entry = base + ((((uint32_t)data[0] << 8 | data[1]) << 4) + ((uint32_t)data[2] << 8 | data[3]));
+                break;
+            case 0x05:  // start linear address
+                entry = base + ((uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3]);
+                break;
+            default:
+                throwError("Unknown Intel HEX record type in " + file + " at line " + std::to_string(line), true);
+        }
+    }
+    return entry;
+}
+
+
+// Verilog $readmemh: whitespace separated hex words, '@addr' sets the word
+// address, '//' and '/* */' comments. The word width is given by the digits
+// of the first word; words are stored little endian.
+static uint32_t load_memh(HexSink & sink, const MappedFile & f, const std::string & file, uint32_t base)
+{
+    const char * p = f.data;
+    const char * end = f.data + f.size;
+    uint64_t word_addr = 0;
+    size_t width = 0;
+    unsigned line = 1;
+
+    while(p < end)
+    {
+        char c = *p;
+        if(c == '\n')
+        {
+            line++;
+            p++;
+        }
+        else if(c == ' ' || c == '\t' || c == '\r')
+        {
+            p++;
+        }
+        else if(c == '/' && p + 1 < end && p[1] == '/')
+        {
+            while(p < end && *p != '\n')
+                p++;
+        }
+        else if(c == '/' && p + 1 < end && p[1] == '*')
+        {
+            p += 2;
+            while(p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+            {
+                if(*p == '\n')
+                    line++;
+                p++;
+            }
+            p += 2;
+        }
+        else if(c == '@')
+        {
+            p++;
+            word_addr = 0;
+            int d;
+            while(p < end && (d = hex_digit(*p)) >= 0)
+            {
+                word_addr = word_addr << 4 | d;
+                p++;
+            }
+        }
+        else
+        {
+            // hex word; '_' separates digits, x/z bits read as 0
+            const char * tok = p;
+            size_t digits = 0;
+            while(p < end && (hex_digit(*p) >= 0 || *p == '_' || (*p | 0x20) == 'x' || (*p | 0x20) == 'z'))
+            {
+                if(*p != '_')
+                    digits++;
+                p++;
+            }
+            if(!digits)
+            {
+                throwError("Invalid character in " + file + " at line " + std::to_string(line), true);
+            }
+            if(!width)
+                width = (digits + 1) / 2;
+            if((digits + 1) / 2 > width || width > 64)
+            {
+                throwError("Word wider than memory in " + file + " at line " + std::to_string(line), true);
+            }
+
+            // digits from the right fill bytes from the least significant one
+            uint8_t word[64] = {};
+            size_t nib = 0;
+            for(const char * q = p; q > tok; )
+            {
+                q--;
+                if(*q == '_')
+                    continue;
+                int d = hex_digit(*q);
+                word[nib / 2] |= (uint8_t)((d < 0 ? 0 : d) << (4 * (nib & 1)));
+                nib++;
+            }
+
+            uint64_t addr = base + word_addr * width;
+            if(addr + width > (1ull << 32))
+            {
+                throwError("Word address out of range in " + file + " at line " + std::to_string(line), true);
+            }
+            sink.put((uint32_t)addr, word, width);
+            word_addr++;
+        }
+    }
+    return base;
+}
+
+
+uint32_t load_hex(MemMap & mem_map, const std::string & file, uint32_t base)
+{
+    MappedFile f(file);
+    HexSink sink(mem_map);
+
+    // Intel HEX records start with ':', anything else is read as $readmemh
+    size_t i = 0;
+    while(i < f.size && isspace((unsigned char)f.data[i]))
+        i++;
+    bool ihex = i < f.size && f.data[i] == ':';
+
+    if(cli_args->verbose_flag)
+        printf("Loading %s file @ 0x%08x (%zu bytes)\n", ihex ? "Intel HEX" : "hex memory", base, f.size);
+
+    return ihex ? load_ihex(sink, f, file, base) : load_memh(sink, f, file, base);
+}
+
+
+std::string image_format(const std::string & file)
+{
+    // ELF files are recognized by content, the rest by extension
+    char magic[4] = {};
+    FILE * fp = fopen(file.c_str(), "rb");
+    if(!fp)
+    {
+        throwError("Can't open input file : " + file, true);
+    }
+    size_t n = fread(magic, 1, 4, fp);
+    fclose(fp);
+    if(n == 4 && magic[0] == 0x7f && magic[1] == 'E' && magic[2] == 'L' && magic[3] == 'F')
+        return "elf";
+
+    std::string ext = file.substr(file.find_last_of('.') == std::string::npos ? file.size() : file.find_last_of('.'));
+    if(ext == ".bin" || ext == ".img")
+        return "bin";
+    if(ext == ".hex" || ext == ".ihex" || ext == ".ihx" || ext == ".mem" || ext == ".vmem" || ext == ".memh")
+        return "hex";
+    return "";
+}
@@ -2,9 +2,12 @@
 #include <iostream>
 #include <fstream>
 #include <stdint.h>
+#include <cstdio>
+#include <cstring>
 
 #include <csignal>
 #include <thread>
+#include <memory>
 
 #include "cxxopts.hpp"
 #include "json.h"
@@ -14,10 +17,47 @@
 
 #include "memsim.h"
 #include "core.h"
+#include "loader.h"
 
 
 SimArgs * cli_args = nullptr;
 
+
+/**
+ * @brief Write the words in [begin, end) to a file, one hex word per line
+ * (RISC-V architecture test signature format)
+ *
+ * @param mem_map memory map
+ * @param begin address of begin_signature
+ * @param end address of end_signature
+ * @param file output file
+ */
+static void dump_signature(MemMap & mem_map, uint32_t begin, uint32_t end, const std::string & file)
+{
+    std::ofstream out(file);
+    if(!out)
+    {
+        throwError("Can't open signature file : " + file, true);
+    }
+    for(uint32_t addr=begin; addr<end; addr+=4)
+    {
+        uint8_t * p = mem_map.translate(addr, 4, MEM_PERM_R);
+        if(!p)
+        {
+            char errmsg[80];
+            sprintf(errmsg, "Signature @ 0x%08x is not readable", addr);
+            throwError(errmsg, true);
+        }
+        uint32_t w;
+        memcpy(&w, p, 4);
+
+        char line[16];
+        sprintf(line, "%08x\n", w);
+        out << line;
+    }
+}
+
+
 void exit_sim(int status)
 {
     // Perform cleanup tasks
@@ -62,7 +102,10 @@ SimArgs *parse_cli_args(int argc, char ** argv, SimArgs * args, const SimArgs *
 		options.add_options("General")
 		("h,help", "Show this message")
 		("version", "Show version information")
-		("f,file", "Specify an input file (bin or hex)", cxxopts::value<std::string>(args->inp_file))
+		("f,file", "Specify an input file (elf, bin or hex)", cxxopts::value<std::string>(args->inp_file))
+		("format", "Specify input file format (auto, elf, bin, hex)", cxxopts::value<std::string>(args->inp_format)->default_value(default_args->inp_format))
+		("load-addr", "Specify load address of bin/hex input files", cxxopts::value<uint32_t>(args->load_addr)->default_value(std::to_string(default_args->load_addr)))
+		("lazy-load", "Load elf/bin images into memory on first access", cxxopts::value<bool>(args->lazy_load)->default_value(BOOLSTRING(default_args->lazy_load)))
         ("v,verbose", "Turn on verbose output", cxxopts::value<bool>(args->verbose_flag)->default_value(BOOLSTRING(default_args->verbose_flag)))
 		;
 
@@ -72,12 +115,15 @@ SimArgs *parse_cli_args(int argc, char ** argv, SimArgs * args, const SimArgs *
 		("b,baud", "Specify virtual uart port baudrate", cxxopts::value<uint16_t>(args->uart_baud)->default_value(std::to_string(default_args->uart_baud)))
         ("isa", "Specify RISC-V ISA to emulate", cxxopts::value<std::string>(args->isa_string)->default_value(default_args->isa_string))
         ("c,config", "Specify configuration file for RVSim", cxxopts::value<std::string>(args->sim_config_json_file)->default_value(default_args->sim_config_json_file))
+        ("e,engine", "Specify execution engine (interp, threaded, block, jit, tiered)", cxxopts::value<std::string>(args->engine)->default_value(default_args->engine))
+        ("pretranslate", "Translate statically reachable code before execution", cxxopts::value<bool>(args->pretranslate)->default_value(BOOLSTRING(default_args->pretranslate)))
+        ("pretranslate-threads", "Specify number of host threads used for pretranslation", cxxopts::value<uint32_t>(args->pretranslate_threads)->default_value(std::to_string(default_args->pretranslate_threads)))
         ;
 
 		options.add_options("Debug")
 		("d,debug", "Start in debug mode", cxxopts::value<bool>(args->debug_flag)->default_value(BOOLSTRING(default_args->debug_flag)))
 		("l,log", "Generate a log of execution", cxxopts::value<std::string>(args->log_file))
-		("signature", "Enable signature dump at hault (Used for riscv compliance tests)", cxxopts::value<std::string>(args->signature_file))
+		("signature", "Dump memory from begin_signature to end_signature (ELF symbols) to a file at halt (Used for riscv compliance tests)", cxxopts::value<std::string>(args->signature_file))
 		;
 
         options.parse_positional({"file"});
@@ -111,6 +157,18 @@ SimArgs *parse_cli_args(int argc, char ** argv, SimArgs * args, const SimArgs *
 		{
 			throwError("No input files specified", true);
 		}
+		if (args->engine != "interp" && args->engine != "threaded" && args->engine != "block" && args->engine != "jit" && args->engine != "tiered")
+		{
+			throwError("Unknown execution engine [" + args->engine + "]", true);
+		}
+		if (args->inp_format != "auto" && args->inp_format != "elf" && args->inp_format != "bin" && args->inp_format != "hex")
+		{
+			throwError("Unknown input file format [" + args->inp_format + "]", true);
+		}
+		if (args->pretranslate_threads == 0)
+		{
+			throwError("Pretranslation needs at least one thread", true);
+		}
     }
     catch(const cxxopts::OptionException& e)
     {
@@ -168,10 +226,43 @@ SimConfig *parse_sim_config(SimConfig * cfg, std::string json_file)
             .name = (*it)["name"],
             .base_addr = (*it)["base"],
             .size = (*it)["size"],
-            .permission = {.r=(*it)["re"], .w=(*it)["we"], .x=(*it)["xe"]}
+            .permission = {.r=(*it)["re"], .w=(*it)["we"], .x=(*it)["xe"]},
+            .backend = (*it).value("backend", "heap"),
+            .hugepage = (*it).value("hugepage", false),
+            .path = (*it).value("path", ""),
+            .shared = (*it).value("shared", false)
         };
+
+        MemBackend backend;
+        if(!Memory::backendFromString(m.backend, backend))
+        {
+            throwError("Unknown memory backend [" + m.backend + "] for memory [" + m.name + "]", true);
+        }
+        if(m.hugepage && backend != MEM_BACKEND_MMAP)
+        {
+            throwError("Huge pages need the mmap backend [memory: " + m.name + "]", true);
+        }
+        if((backend == MEM_BACKEND_FILE || backend == MEM_BACKEND_SHM) && m.path.empty())
+        {
+            throwError("Memory [" + m.name + "] needs a backing path", true);
+        }
+        if(backend == MEM_BACKEND_SHM && m.path[0] != '/')
+        {
+            throwError("Shared memory object name must start with '/' [memory: " + m.name + "]", true);
+        }
         cfg->memories.push_back((m));
     }
+
+    // Get tiering thresholds (optional)
+    cfg->tiering.threaded_threshold = TierManager::DEFAULT_THREADED_THRESHOLD;
+    cfg->tiering.native_threshold = TierManager::DEFAULT_NATIVE_THRESHOLD;
+    if(jcfg.contains("TIER"))
+    {
+        nlohmann::json & t = jcfg["TIER"];
+        cfg->tiering.threaded_threshold = t.value("threaded", cfg->tiering.threaded_threshold);
+        cfg->tiering.native_threshold = t.value("native", cfg->tiering.native_threshold);
+        DBG_PRINT("  TIER: threaded@" << cfg->tiering.threaded_threshold << " native@" << cfg->tiering.native_threshold);
+    }
     return cfg;
 }
 
@@ -191,7 +282,14 @@ int main(int argc, char **argv)
         .uart_baud=9600,
         .log_file="",
         .signature_file="",
-        .sim_config_json_file="rvsim_default.json"
+        .isa_string="rv32im",
+        .sim_config_json_file="rvsim_default.json",
+        .engine="tiered",
+        .pretranslate=false,
+        .pretranslate_threads=1,
+        .inp_format="auto",
+        .load_addr=0,
+        .lazy_load=false
     };
 
     SimArgs args;
@@ -215,52 +313,152 @@ int main(int argc, char **argv)
     // Create memory
     for(int i=0; i<sim_configs.memories.size(); i++)
     {
-        sim_memory.push_back(Memory(
+        MemBacking backing;
+        Memory::backendFromString(sim_configs.memories[i].backend, backing.backend);
+        backing.hugepage = sim_configs.memories[i].hugepage;
+        backing.path = sim_configs.memories[i].path;
+        backing.shared = sim_configs.memories[i].shared;
+
+        sim_memory.emplace_back(
             sim_configs.memories[i].base_addr,
             sim_configs.memories[i].size,
             sim_configs.memories[i].permission.r,
             sim_configs.memories[i].permission.w,
-            sim_configs.memories[i].permission.x
-        ));
+            sim_configs.memories[i].permission.x,
+            backing
+        );
     }
 
+    // Page table over all regions, shared by the cores
+    MemMap sim_memmap(sim_memory);
+
     // Initialize memory
-    
+    std::string format = (args.inp_format == "auto") ? image_format(args.inp_file) : args.inp_format;
+    uint32_t entry;
+    if(format == "elf")
+        entry = load_elf(sim_memmap, args.inp_file);
+    else if(format == "bin")
+        entry = load_bin(sim_memmap, args.inp_file, args.load_addr);
+    else if(format == "hex")
+        entry = load_hex(sim_memmap, args.inp_file, args.load_addr);
+    else
+        throwError("Unable to detect format of input file [" + args.inp_file + "]; use --format", true);
+    if(args.verbose_flag)
+    {
+        printf("Entry point: 0x%08x\n", entry);
+    }
+
+    // Signature bounds come from the ELF symbol table
+    uint32_t sig_begin = 0, sig_end = 0;
+    if(!args.signature_file.empty())
+    {
+        bool found_begin = false, found_end = false;
+        if(format == "elf")
+        {
+            std::vector<ElfSymbol> symbols = elf_symbols(args.inp_file);
+            for(size_t i=0; i<symbols.size(); i++)
+            {
+                if(symbols[i].name == "begin_signature")
+                {
+                    sig_begin = symbols[i].value;
+                    found_begin = true;
+                }
+                else if(symbols[i].name == "end_signature")
+                {
+                    sig_end = symbols[i].value;
+                    found_end = true;
+                }
+            }
+        }
+        if(!found_begin || !found_end || sig_begin > sig_end || (sig_begin & 0x3))
+        {
+            throwError("Signature needs an ELF file defining aligned begin_signature & end_signature symbols", true);
+        }
+    }
+
+    // Select ISA variant
+    const RVIsa * isa = RVCore::isa_variant(rv_isa_parse(args.isa_string));
+    if(!isa)
+    {
+        throwError("ISA [" + args.isa_string + "] is not supported by this build of RVSim", true);
+    }
+    if(args.verbose_flag)
+    {
+        std::cout << "ISA: " << isa->name << std::endl;
+    }
+
+    // Find code reachable from the entry point (& ELF function symbols) and
+    // translate it once for all cores
+    Pretranslation pretranslated;
+    if(args.pretranslate)
+    {
+        std::vector<uint32_t> roots = {entry};
+        if(format == "elf")
+        {
+            std::vector<uint32_t> symbols = elf_code_roots(args.inp_file);
+            roots.insert(roots.end(), symbols.begin(), symbols.end());
+        }
+        std::vector<CfgBlock> code_blocks = cfg_discover(sim_memmap, isa, roots);
+        if(args.verbose_flag)
+        {
+            std::cout << "pretranslate: " << code_blocks.size() << " blocks" << std::endl;
+        }
+        pretranslated = RVCore::pretranslate(sim_memmap, isa, code_blocks, args.pretranslate_threads);
+    }
+
     // Initialize processors
-    std::vector<RVCore> sim_cores;
-    sim_cores.reserve(sim_configs.cores.size());
+    std::vector<std::unique_ptr<RVCore>> sim_cores(sim_configs.cores.size());
 
-    for(int i=0; i<sim_configs.cores.size(); i++)
+    auto create_core = [&](int i)
     {
-        sim_cores.push_back(RVCore(
+        sim_cores[i].reset(new RVCore(
             sim_configs.cores[i].id,
-            &sim_memory,
-            0x00000000
+            &sim_memmap,
+            entry,
+            isa
         ));
-    }
+        sim_cores[i]->set_tiering(sim_configs.tiering);
+        if(args.pretranslate)
+        {
+            sim_cores[i]->use_pretranslation(pretranslated);
+        }
+    };
 
 
     // Run simulation
     #ifdef CORE_SCHEDULING_ROUND_ROBIN
-    while(true)
+    for(int i=0; i<sim_configs.cores.size(); i++)
     {
+        create_core(i);
+    }
+
+    bool all_halted = false;
+    while(!all_halted)
+    {
+        all_halted = true;
         for(int i=0; i<sim_configs.cores.size(); i++)
         {
-            if(!sim_cores[i].is_halted())
-                sim_cores[i].tick();
-            else
+            if(!sim_cores[i]->is_halted())
             {
-                LOG_DUMP("core[" << sim_cores[i].get_id() << "] halted");
+                sim_cores[i]->tick();
+                all_halted = false;
             }
         }
     }
     #else 
     #ifdef CORE_SCHEDULING_MULTI_THREAD
     
+    // Each thread allocates the hart it runs, so its state (and the caches
+    // hanging off it) comes from that thread's allocator arena and is first
+    // touched by the host cpu using it
     std::vector<std::thread> active_thr;
     for(int i=0; i<sim_configs.cores.size(); i++)
     {
-        active_thr.push_back(std::thread(&RVCore::run, &sim_cores[i]));
+        active_thr.push_back(std::thread([&create_core, &sim_cores, i]()
+        {
+            create_core(i);
+            sim_cores[i]->run();
+        }));
     }
 
     for(int i=0; i<active_thr.size(); i++)
@@ -274,8 +472,25 @@ int main(int argc, char **argv)
     #endif
     #endif
 
-    
-    // control must never reach here
-    throwError("[INTERNAL]: Control fault in main.cpp", true);
+    for(int i=0; i<sim_configs.cores.size(); i++)
+    {
+        LOG_DUMP("core[" + std::to_string(sim_cores[i]->get_id()) + "] halted, instret: " + std::to_string(sim_cores[i]->get_instret()));
+
+        if(args.verbose_flag)
+        {
+            size_t tier_blocks[TierManager::TIER_COUNT];
+            sim_cores[i]->get_tier_counts(tier_blocks);
+            std::cout << "core[" << sim_cores[i]->get_id() << "] blocks: interp=" << tier_blocks[TierManager::TIER_INTERP]
+                << " threaded=" << tier_blocks[TierManager::TIER_THREADED]
+                << " native=" << tier_blocks[TierManager::TIER_NATIVE] << std::endl;
+        }
+    }
+
+    if(!args.signature_file.empty())
+    {
+        dump_signature(sim_memmap, sig_begin, sig_end, args.signature_file);
+    }
+
+    exit_sim(EXIT_SUCCESS);
     return 0;
 }
\ No newline at end of file
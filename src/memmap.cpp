@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <string>
+#include <cstdio>
+
+#include "util.h"
+#include "memmap.h"
+
+// target of all level 1 slots without mapped pages
+MemMap::Entry MemMap::empty_table[MemMap::L2_SIZE];
+
+
+MemMap::MemMap(std::vector<Memory> & regions) :
+    regions(regions)
+{
+    for(uint32_t i=0; i<L1_SIZE; i++)
+    {
+        l1[i] = empty_table;
+    }
+
+    for(size_t r=0; r<regions.size(); r++)
+    {
+        Memory & m = regions[r];
+        uint64_t base = m.base_addr;
+        uint64_t end = base + m.size;
+
+        // an empty region would underflow end-1 below
+        if(m.size == 0)
+        {
+            char errmsg[80];
+            sprintf(errmsg, "Memory region @ 0x%08x has zero size", m.base_addr);
+            throwError(errmsg, true);
+        }
+        if(end > (1ull << 32))
+        {
+            char errmsg[80];
+            sprintf(errmsg, "Memory region @ 0x%08x exceeds the 32-bit address space", m.base_addr);
+            throwError(errmsg, true);
+        }
+        // aligned guest words must be aligned host words (atomics)
+        if(base & 0x3)
+        {
+            char errmsg[80];
+            sprintf(errmsg, "Memory region @ 0x%08x is not 4-byte aligned", m.base_addr);
+            throwError(errmsg, true);
+        }
+        for(size_t o=0; o<r; o++)
+        {
+            if(base < (uint64_t)regions[o].base_addr + regions[o].size && regions[o].base_addr < end)
+            {
+                char errmsg[80];
+                sprintf(errmsg, "Memory regions @ 0x%08x and 0x%08x overlap", regions[o].base_addr, m.base_addr);
+                throwError(errmsg, true);
+            }
+        }
+
+        // every page the region touches gets an entry (code tracking), only
+        // pages that lie completely inside the region are mapped directly
+        uint32_t perm = mem_perm(m);
+        for(uint64_t page=(base >> PAGE_BITS); page<=((end-1) >> PAGE_BITS); page++)
+        {
+            uint32_t i = page >> L2_BITS;
+            if(l1[i] == empty_table)
+            {
+                tables.emplace_back(new Entry[L2_SIZE]);
+                l1[i] = tables.back().get();
+                for(uint32_t j=0; j<L2_SIZE; j++)
+                {
+                    l1[i][j].host = nullptr;
+                    l1[i][j].perm.store(0);
+                    l1[i][j].gen.store(0);
+                    l1[i][j].dirty = nullptr;
+                }
+            }
+
+            Entry & e = l1[i][page & (L2_SIZE-1)];
+            if((page << PAGE_BITS) >= base && ((page+1) << PAGE_BITS) <= end)
+            {
+                e.host = m.mem + ((page << PAGE_BITS) - base);
+                e.perm.store(perm | MEM_PAGE_REGION(perm));
+                e.dirty = m.dirtyWord(page << PAGE_BITS);
+            }
+            else
+            {
+                // shared with a neighbouring region, see _mark_dirty_slow()
+                e.host = nullptr;
+                e.dirty = nullptr;
+                e.perm.store(MEM_PAGE_REGION(perm));
+            }
+        }
+    }
+}
+
+
+Memory * MemMap::region(uint32_t addr, uint32_t len)
+{
+    for(size_t r=0; r<regions.size(); r++)
+    {
+        if(regions[r].isValidAddress(addr) && (uint64_t)addr + len <= (uint64_t)regions[r].base_addr + regions[r].size)
+            return &regions[r];
+    }
+    return nullptr;
+}
+
+
+uint8_t * MemMap::_translate_slow(uint32_t addr, uint32_t len, uint32_t perm)
+{
+    // region edges that are not page aligned & accesses crossing pages
+    Memory * m = region(addr, len);
+    if(!m || (mem_perm(*m) & perm) != perm)
+        return nullptr;
+    return m->mem + m->global2local(addr);
+}
+
+
+void MemMap::_mark_dirty_slow(uint32_t addr, uint32_t len)
+{
+    // region edges that are not page aligned & accesses crossing pages
+    Memory * m = region(addr, len);
+    if(m)
+        m->markDirty(addr, len);
+}
+
+
+bool MemMap::code_written(uint32_t addr, uint32_t len)
+{
+    bool hit = false;
+    for(uint64_t page=(addr >> PAGE_BITS); page<=(((uint64_t)addr+len-1) >> PAGE_BITS); page++)
+    {
+        Entry * table = l1[page >> L2_BITS];
+        Entry & e = table[page & (L2_SIZE-1)];
+        uint32_t perm = e.perm.load(std::memory_order_relaxed);
+        if(table == empty_table || !(perm & MEM_PAGE_CODE))
+            continue;
+
+        // new generation first: whoever sees the write permission restored
+        // must also see the page as changed
+        e.gen.fetch_add(1, std::memory_order_release);
+        uint32_t region = (perm >> 8) & (MEM_PERM_R | MEM_PERM_W | MEM_PERM_X);
+        e.perm.store((e.host ? region : 0) | MEM_PAGE_REGION(region), std::memory_order_release);
+        hit = true;
+    }
+    return hit;
+}
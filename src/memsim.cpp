@@ -2,52 +2,403 @@
 #include <string>
 #include <vector>
 #include <cstdio>
-
-#include "elfio.hpp"
+#include <new>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <thread>
+#include <mutex>
+#include <memory>
 
 #include "defs.h"
 #include "memsim.h"
 
 extern SimArgs * cli_args;
 
-Memory::Memory(uint32_t base_addr, size_t size, bool re, bool we, bool xe)
+// transparent huge page size (x86-64, aarch64 with 4K base pages)
+#define MEM_HUGEPAGE_SIZE   (2ul << 20)
+
+
+/**
+ * @brief Fills pages of lazily loaded images from their files when they are
+ * first touched (userfaultfd). Registered ranges must be fresh anonymous
+ * memory; a server thread copies each missing page in from the file.
+ */
+class LazyPager
+{
+    public:
+    static LazyPager & instance()
+    {
+        static LazyPager pager;
+        return pager;
+    }
+
+    /**
+     * @brief Page [host, host+len) in from fd at offset on demand
+     *
+     * @return false if userfaultfd is not available
+     */
+    bool add(uint8_t * host, size_t len, int fd, uint64_t offset)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!_open())
+            return false;
+
+        int file = dup(fd);
+        if(file < 0)
+            return false;
+
+        // fresh pages: only missing pages fault
+        if(mmap(host, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            close(file);
+            return false;
+        }
+
+        struct uffdio_register reg;
+        reg.range.start = (uintptr_t)host;
+        reg.range.len = len;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if(ioctl(uffd, UFFDIO_REGISTER, &reg) != 0)
+        {
+            close(file);
+            return false;
+        }
+
+        Range r = {(uintptr_t)host, (uintptr_t)host + len, file, offset};
+        ranges.push_back(r);
+        return true;
+    }
+
+    private:
+    struct Range
+    {
+        uintptr_t start;
+        uintptr_t end;
+        int fd;
+        uint64_t offset;
+    };
+
+    std::mutex lock;
+    std::vector<Range> ranges;
+    int uffd = -1;
+    bool unavailable = false;
+
+    bool _open()
+    {
+        if(uffd >= 0 || unavailable)
+            return !unavailable;
+
+        uffd = syscall(SYS_userfaultfd, O_CLOEXEC);
+        struct uffdio_api api;
+        api.api = UFFD_API;
+        api.features = 0;
+        if(uffd < 0 || ioctl(uffd, UFFDIO_API, &api) != 0)
+        {
+            if(uffd >= 0)
+                close(uffd);
+            uffd = -1;
+            unavailable = true;
+            if(cli_args && cli_args->verbose_flag)
+                printf("userfaultfd not available, images are paged in by the kernel or copied\n");
+            return false;
+        }
+
+        // runs until the simulator exits
+        std::thread(&LazyPager::_serve, this).detach();
+        return true;
+    }
+
+    void _serve()
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        std::unique_ptr<uint8_t[]> buf(new uint8_t[page]);
+        while(true)
+        {
+            struct uffd_msg msg;
+            ssize_t n = read(uffd, &msg, sizeof(msg));
+            if(n != sizeof(msg))
+            {
+                if(n < 0 && errno == EINTR)
+                    continue;
+                throwError("userfaultfd: lost page fault server", true);
+            }
+            if(msg.event != UFFD_EVENT_PAGEFAULT)
+                continue;
+
+            uintptr_t addr = msg.arg.pagefault.address & ~(uintptr_t)(page - 1);
+            Range r = {0, 0, -1, 0};
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for(size_t i=0; i<ranges.size(); i++)
+                {
+                    if(addr >= ranges[i].start && addr < ranges[i].end)
+                        r = ranges[i];
+                }
+            }
+
+            // ranges are whole pages of file contents
+            ssize_t got = (r.fd >= 0) ? pread(r.fd, buf.get(), page, r.offset + (addr - r.start)) : 0;
+            if(got < (ssize_t)page)
+                memset(buf.get() + (got > 0 ? got : 0), 0, page - (got > 0 ? got : 0));
+
+            struct uffdio_copy copy;
+            copy.dst = addr;
+            copy.src = (uintptr_t)buf.get();
+            copy.len = page;
+            copy.mode = 0;
+            // EEXIST: the page was filled meanwhile
+            if(ioctl(uffd, UFFDIO_COPY, &copy) != 0 && errno != EEXIST)
+                throwError("userfaultfd: unable to fill page", true);
+        }
+    }
+};
+
+Memory::Memory(uint32_t base_addr, size_t size, bool re, bool we, bool xe, const MemBacking & backing)
 : 
 	base_addr(base_addr),
 	size(size),
-	re(re), we(we), xe(xe)
+	re(re), we(we), xe(xe),
+	backend(backing.backend)
 {
     // Allocate memory
-    if(!(mem = new uint8_t[size]))
+    switch(backend)
     {
-        throwError("out of memory; memory allocation failed\n", true);
+        case MEM_BACKEND_HEAP:
+            if(!(mem = new (std::nothrow) uint8_t[size]()))
+            {
+                throwError("out of memory; memory allocation failed\n", true);
+            }
+            break;
+        case MEM_BACKEND_MMAP:
+            mapAnonymous(backing.hugepage);
+            remappable = true;
+            break;
+        case MEM_BACKEND_FILE:
+            mapFile(backing);
+            remappable = !backing.shared;
+            break;
+        case MEM_BACKEND_SHM:
+            mapShm(backing);
+            break;
+    }
+
+    // one bit per page the memory touches, words aligned to 64 pages so
+    // the bit of a page only depends on its address
+    if(size)
+    {
+        dirty_base = base_addr >> (DIRTY_PAGE_BITS + 6);
+        dirty_words = (((uint64_t)base_addr + size - 1) >> (DIRTY_PAGE_BITS + 6)) - dirty_base + 1;
+        dirty.reset(new std::atomic<uint64_t>[dirty_words]());
     }
 }
 
 
-Memory::~Memory()
+void Memory::mapAnonymous(bool hugepage)
 {
-    delete [] mem;
-    size = 0;
+    // Nothing is committed until touched; huge pages need a 2M aligned
+    // range, so map the slack and trim it off again
+    size_t align = hugepage ? MEM_HUGEPAGE_SIZE : 0;
+    void * p = mmap(nullptr, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED)
+    {
+        throwError("out of memory; memory mapping failed\n", true);
+    }
+    mem = (uint8_t *)p;
+
+    if(hugepage)
+    {
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t raw = (uintptr_t)p;
+        uintptr_t start = (raw + align - 1) & ~(uintptr_t)(align - 1);
+        uintptr_t end = raw + size + align;
+        uintptr_t used_end = (start + size + page - 1) & ~(page - 1);
+        if(start > raw)
+            munmap((void *)raw, start - raw);
+        if(end > used_end)
+            munmap((void *)used_end, end - used_end);
+        mem = (uint8_t *)start;
+
+        // only a hint: without THP support the memory is still usable
+        if(madvise(mem, size, MADV_HUGEPAGE) != 0 && cli_args && cli_args->verbose_flag)
+        {
+            printf("Huge pages not available for memory @ 0x%08x\n", base_addr);
+        }
+    }
+}
+
+
+void Memory::mapFile(const MemBacking & backing)
+{
+    // shared files hold the whole region (created/extended as needed), so
+    // guest stores persist; private mappings only read the file
+    int fd = backing.shared ? open(backing.path.c_str(), O_RDWR | O_CREAT, 0644) : open(backing.path.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+        throwError("Unable to open memory backing file [" + backing.path + "]: " + strerror(errno), true);
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throwError("Unable to stat memory backing file [" + backing.path + "]: " + strerror(errno), true);
+    }
+
+    if(backing.shared)
+    {
+        if((size_t)st.st_size < size && ftruncate(fd, size) != 0)
+        {
+            close(fd);
+            throwError("Unable to resize memory backing file [" + backing.path + "]: " + strerror(errno), true);
+        }
+
+        void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(p == MAP_FAILED)
+        {
+            throwError("Unable to map memory backing file [" + backing.path + "]: " + strerror(errno), true);
+        }
+        mem = (uint8_t *)p;
+        return;
+    }
+
+    // Private: zero-filled anonymous memory with the file mapped over its
+    // start; pages past the end of the file would fault when touched
+    mapAnonymous(false);
+    size_t file_len = std::min((size_t)st.st_size, size);
+    if(file_len && mmap(mem, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        close(fd);
+        throwError("Unable to map memory backing file [" + backing.path + "]: " + strerror(errno), true);
+    }
+    close(fd);
 }
 
 
-uint32_t Memory::fetchWord(uint32_t addr)
+void Memory::mapShm(const MemBacking & backing)
 {
-    uint32_t byte0 = (uint32_t)fetchByte(addr);
-    uint32_t byte1 = (uint32_t)fetchByte(addr+1);
-    uint32_t byte2 = (uint32_t)fetchByte(addr+2);
-    uint32_t byte3 = (uint32_t)fetchByte(addr+3);
+    // the object outlives the simulation, other processes can attach to it
+    int fd = shm_open(backing.path.c_str(), O_RDWR | O_CREAT, 0600);
+    if(fd < 0)
+    {
+        throwError("Unable to open shared memory object [" + backing.path + "]: " + strerror(errno), true);
+    }
 
-    return ((byte3<<24) & 0xff000000) | ((byte2<<16) & 0x00ff0000) | ((byte1<<8) & 0x0000ff00) | (byte0 & 0x000000ff);
+    struct stat st;
+    if(fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, size) != 0))
+    {
+        close(fd);
+        throwError("Unable to size shared memory object [" + backing.path + "]: " + strerror(errno), true);
+    }
+
+    void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+    {
+        throwError("Unable to map shared memory object [" + backing.path + "]: " + strerror(errno), true);
+    }
+    mem = (uint8_t *)p;
 }
 
 
-uint16_t Memory::fetchHalfWord(uint32_t addr)
+Memory::Memory(Memory && other) noexcept
+:
+	mem(other.mem),
+	base_addr(other.base_addr),
+	size(other.size),
+	re(other.re), we(other.we), xe(other.xe),
+	backend(other.backend),
+	remappable(other.remappable),
+	dirty(std::move(other.dirty)),
+	dirty_base(other.dirty_base),
+	dirty_words(other.dirty_words)
 {
-    uint32_t byte0 = (uint32_t)fetchByte(addr);
-    uint32_t byte1 = (uint32_t)fetchByte(addr+1);
+    other.mem = nullptr;
+    other.size = 0;
+}
+
 
-    return ((byte1<<8) & 0xff00) | (byte0 & 0x00ff);
+Memory & Memory::operator=(Memory && other) noexcept
+{
+    if(this != &other)
+    {
+        release();
+        mem = other.mem;
+        base_addr = other.base_addr;
+        size = other.size;
+        re = other.re;
+        we = other.we;
+        xe = other.xe;
+        backend = other.backend;
+        remappable = other.remappable;
+        dirty = std::move(other.dirty);
+        dirty_base = other.dirty_base;
+        dirty_words = other.dirty_words;
+        other.mem = nullptr;
+        other.size = 0;
+    }
+    return *this;
+}
+
+
+Memory::~Memory()
+{
+    release();
+}
+
+
+void Memory::release()
+{
+    if(mem)
+    {
+        switch(backend)
+        {
+            case MEM_BACKEND_HEAP:
+                delete [] mem;
+                break;
+            case MEM_BACKEND_MMAP:
+            case MEM_BACKEND_FILE:
+            case MEM_BACKEND_SHM:
+                munmap(mem, size);
+                break;
+        }
+    }
+    mem = nullptr;
+    size = 0;
+}
+
+
+bool Memory::backendFromString(const std::string & name, MemBackend & backend)
+{
+    if(name == "heap")
+        backend = MEM_BACKEND_HEAP;
+    else if(name == "mmap")
+        backend = MEM_BACKEND_MMAP;
+    else if(name == "file")
+        backend = MEM_BACKEND_FILE;
+    else if(name == "shm")
+        backend = MEM_BACKEND_SHM;
+    else
+        return false;
+    return true;
+}
+
+
+uint64_t Memory::fetchBytes(uint32_t addr, uint32_t n)
+{
+    uint64_t value = 0;
+    for(uint32_t i=0; i<n; i++)
+    {
+        value |= (uint64_t)fetchByte(addr+i) << (8*i);
+    }
+    return value;
 }
 
 
@@ -65,19 +416,12 @@ uint8_t Memory::fetchByte(uint32_t addr)
 }
 
 
-void Memory::storeWord(uint32_t addr, uint32_t w)
-{
-    storeByte(addr,   (uint8_t) (w & 0x000000ff));
-    storeByte(addr+1, (uint8_t) ((w & 0x0000ff00) >> 8));
-    storeByte(addr+2, (uint8_t) ((w & 0x00ff0000) >> 16));
-    storeByte(addr+3, (uint8_t) ((w & 0xff000000) >> 24));
-}
-
-
-void Memory::storeHalfWord(uint32_t addr, uint16_t hw)
+void Memory::storeBytes(uint32_t addr, uint64_t value, uint32_t n)
 {
-    storeByte(addr, (uint8_t) (hw & 0x00ff));
-    storeByte(addr+1, (uint8_t) ((hw & 0xff00) >> 8));
+    for(uint32_t i=0; i<n; i++)
+    {
+        storeByte(addr+i, (uint8_t)(value >> (8*i)));
+    }
 }
 
 
@@ -92,69 +436,149 @@ void Memory::storeByte(uint32_t addr, uint8_t byte)
     }
 
     mem[global2local(addr)] = byte;
+    setDirty(addr);
 }
 
 
-unsigned int Memory::initFromElf(std::string ifile, std::vector<int> flags_signatures)
-	{
-		// Initialize Memory object from input ELF File
-		ELFIO::elfio reader;
-
-		// Load file into elf reader
-		if (!reader.load(ifile)) 
-		{
-			throwError("Can't find or process ELF file : " + ifile + "\n", true);
-		}
-
-		// Check ELF Class, Endiness & segment count
-		if(reader.get_class() != ELFCLASS32)
-			throwError("Elf file format invalid: should be 32-bit elf\n", true);
-		if(reader.get_encoding() != ELFDATA2LSB)
-			throwError("Elf file format invalid: should be little Endian\n", true);
-
-		ELFIO::Elf_Half seg_num = reader.segments.size();
-
-		if(seg_num == 0)
-			throwError("Elf file format invalid: should consist of atleast one section\n", true);
-
-
-		// Read elf and initialize memory
-		if(cli_args->verbose_flag)
-			std::cout << "Segments found : "<< seg_num <<"\n";
-
-		unsigned int i = 0;
-		while (i < seg_num) // iterate over all segments
-		{
-			const ELFIO::segment * seg = reader.segments[i];
-
-			// Get segment properties
-			
-			if (seg->get_type() == SHT_PROGBITS)
-			{
-				int seg_flags = reader.segments[i]->get_flags();
-
-				if(flags_signatures.end() != std::find(flags_signatures.begin(), flags_signatures.end(), seg_flags))	// Flag found in signature list
-				{
-
-					const char* seg_data = reader.segments[i]->get_data();
-					const uint seg_size = reader.segments[i]->get_file_size();
-					ELFIO::Elf64_Addr seg_strt_addr = reader.segments[i]->get_physical_address();
-
-					if(cli_args->verbose_flag)
-						printf("Loading Segment %d @ 0x%08x --- ", i, (unsigned int) reader.segments[i]->get_physical_address());
-					
-					long unsigned int offset = 0;
-					while(offset<seg_size)
-					{
-						storeByte(seg_strt_addr + offset, seg_data[offset]);
-						offset++;
-					}
-
-					if(cli_args->verbose_flag)
-						printf("done\n");
-				}
-			}
-			i++;
-		}
-		return (unsigned int) reader.get_entry();
-	}
\ No newline at end of file
+void Memory::read(uint32_t addr, void * dst, size_t len)
+{
+    if(!isValidRange(addr, len))
+    {
+        char errmsg[64];
+        sprintf(errmsg, "Address range out of bounds : 0x%08x (+%zu)", addr, len);
+        throwError(errmsg, true);
+        return;
+    }
+
+    memcpy(dst, mem + global2local(addr), len);
+}
+
+
+void Memory::write(uint32_t addr, const void * src, size_t len)
+{
+    if(!isValidRange(addr, len))
+    {
+        char errmsg[64];
+        sprintf(errmsg, "Address range out of bounds : 0x%08x (+%zu)", addr, len);
+        throwError(errmsg, true);
+        return;
+    }
+
+    memcpy(mem + global2local(addr), src, len);
+    markDirty(addr, len);
+}
+
+
+void Memory::zero(uint32_t addr, size_t len)
+{
+    if(!isValidRange(addr, len))
+    {
+        char errmsg[64];
+        sprintf(errmsg, "Address range out of bounds : 0x%08x (+%zu)", addr, len);
+        throwError(errmsg, true);
+        return;
+    }
+
+    uint8_t * dst = mem + global2local(addr);
+    if(remappable)
+    {
+        // fresh anonymous pages are zero and take no memory until touched
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = ((uintptr_t)dst + page - 1) & ~(page - 1);
+        uintptr_t end = ((uintptr_t)dst + len) & ~(page - 1);
+        if(start < end && mmap((void *)start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) != MAP_FAILED)
+        {
+            memset(dst, 0, start - (uintptr_t)dst);
+            memset((void *)end, 0, (uintptr_t)dst + len - end);
+            markDirty(addr, len);
+            return;
+        }
+    }
+    memset(dst, 0, len);
+    markDirty(addr, len);
+}
+
+
+size_t Memory::writeFromFile(uint32_t addr, const void * src, size_t len, int fd, uint64_t offset, bool lazy)
+{
+    if(!isValidRange(addr, len))
+    {
+        char errmsg[64];
+        sprintf(errmsg, "Address range out of bounds : 0x%08x (+%zu)", addr, len);
+        throwError(errmsg, true);
+        return 0;
+    }
+
+    // Only pages lying completely inside the range are mapped or paged in
+    // lazily; head and tail are copied so neighbouring data in the same pages
+    // is kept
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint8_t * dst = mem + global2local(addr);
+    uint64_t head = ((page - ((uintptr_t)dst & (page-1))) & (page-1));
+    size_t body = (remappable && fd >= 0 && len > head) ? (len - head) & ~(page-1) : 0;
+
+    // file pages can be mapped when the file offset and the host address
+    // agree modulo the page size
+    bool congruent = ((uintptr_t)dst & (page-1)) == (offset & (page-1));
+
+    size_t mapped = 0;
+    if(body)
+    {
+        if(!we && congruent && mmap(dst + head, body, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset + head) != MAP_FAILED)
+            mapped = body;
+        else if(lazy && LazyPager::instance().add(dst + head, body, fd, offset + head))
+            mapped = body;
+        else if(lazy && congruent && mmap(dst + head, body, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset + head) != MAP_FAILED)
+            mapped = body;  // no userfaultfd: let the kernel page the file in
+    }
+
+    if(mapped)
+    {
+        memcpy(dst, src, head);
+        memcpy(dst + head + body, (const uint8_t *)src + head + body, len - head - body);
+    }
+    else
+    {
+        memcpy(dst, src, len);
+    }
+    markDirty(addr, len);
+    return mapped;
+}
+
+
+void Memory::markDirty(uint32_t addr, size_t len)
+{
+    if(!len)
+        return;
+    for(uint64_t page=(addr >> DIRTY_PAGE_BITS); page<=(((uint64_t)addr+len-1) >> DIRTY_PAGE_BITS); page++)
+    {
+        setDirty(page << DIRTY_PAGE_BITS);
+    }
+}
+
+
+size_t Memory::dirtyPages(std::vector<uint32_t> & pages, bool clear)
+{
+    size_t count = 0;
+    for(size_t i=0; i<dirty_words; i++)
+    {
+        uint64_t bits = clear ? dirty[i].exchange(0, std::memory_order_acq_rel) : dirty[i].load(std::memory_order_acquire);
+        while(bits)
+        {
+            uint64_t page = ((uint64_t)(dirty_base + i) << 6) + __builtin_ctzll(bits);
+            pages.push_back(page << DIRTY_PAGE_BITS);
+            bits &= bits - 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+
+void Memory::clearDirty()
+{
+    for(size_t i=0; i<dirty_words; i++)
+    {
+        dirty[i].store(0, std::memory_order_relaxed);
+    }
+}
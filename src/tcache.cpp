@@ -0,0 +1,475 @@
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+
+#include "defs.h"
+#include "util.h"
+#include "core.h"
+#include "rvexec.h"
+
+extern SimArgs * cli_args;
+
+// ra and t0 are link registers (calling convention hint in the ISA spec)
+static inline bool is_link_reg(uint8_t r)
+{
+    return r == 1 || r == 5;
+}
+
+// Instruction word for translation; callers make sure pc is executable
+static inline uint32_t code_word(MemMap * mem_map, uint32_t pc)
+{
+    uint8_t * p = mem_map->translate(pc, 4, MEM_PERM_X);
+
+    // translated, so stores to the page must be watched from now on
+    mem_map->mark_code(pc);
+
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return w;
+}
+
+
+TBlock * RVCore::_translate(uint32_t start)
+{
+    uint32_t gen;
+    TBlock * b = _build_block(mem_map, isa, start, gen);
+    return tcache.insert(b, gen);
+}
+
+
+Pretranslation RVCore::pretranslate(MemMap & mem_map, const RVIsa * isa, const std::vector<CfgBlock> & blocks, unsigned threads)
+{
+    Pretranslation p;
+
+    // the decode based engines only need their records filled in
+    if(cli_args->engine == "interp" || cli_args->engine == "threaded")
+    {
+        for(size_t i=0; i<blocks.size(); i++)
+        {
+            for(uint32_t pc=blocks[i].pc; pc<blocks[i].pc + 4*blocks[i].len; pc+=4)
+            {
+                DecodedInsn d;
+                isa->decode(code_word(&mem_map, pc), d);
+                p.pcs.push_back(pc);
+                p.insns.push_back(d);
+            }
+        }
+        return p;
+    }
+
+    // Building a block only reads guest memory (and marks its page as code),
+    // so blocks are built in parallel
+    std::vector<TBlock *> built(blocks.size(), nullptr);
+    p.gens.resize(blocks.size());
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]()
+    {
+        for(size_t i=next++; i<blocks.size(); i=next++)
+        {
+            built[i] = _build_block(&mem_map, isa, blocks[i].pc, p.gens[i]);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(unsigned t=1; t<threads; t++)
+    {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for(size_t t=0; t<pool.size(); t++)
+    {
+        pool[t].join();
+    }
+
+    p.blocks.reserve(built.size());
+    for(size_t i=0; i<built.size(); i++)
+    {
+        p.blocks.push_back(std::move(*built[i]));
+        delete built[i];
+    }
+    return p;
+}
+
+
+void RVCore::use_pretranslation(const Pretranslation & p)
+{
+    for(size_t i=0; i<p.insns.size(); i++)
+    {
+        DecodedInsn * slot = dcache.lookup(p.pcs[i]);
+        if(slot->op == OP_UNDECODED)
+            *slot = p.insns[i];
+    }
+
+    // blocks are copied unlinked, each core chains its own
+    for(size_t i=0; i<p.blocks.size(); i++)
+    {
+        if(!tcache.lookup(p.blocks[i].pc))
+            tcache.insert(new TBlock(p.blocks[i]), p.gens[i]);
+    }
+}
+
+
+TBlock * RVCore::_build_block(MemMap * mem_map, const RVIsa * isa, uint32_t start, uint32_t & gen)
+{
+    // misaligned pcs are interpreted (and trap) by run_blocks(), discovered
+    // blocks are aligned
+    assert(!(start & 0x3));
+
+    TBlock * b = new TBlock;
+    b->pc = start;
+    b->len = 0;
+    b->exit_pc[0] = b->exit_pc[1] = TBLOCK_NO_EXIT;
+    b->link[0] = b->link[1] = nullptr;
+    b->exit_flags = 0;
+    b->ret_link = nullptr;
+    b->exec_count = 0;
+    b->native = nullptr;
+
+    // generation before the first fetch, later stores show up as a change
+    gen = mem_map->page_gen(start);
+
+    // blocks never cross a page boundary
+    uint64_t page_end = ((uint64_t)start | (DecodeCache::PAGE_SIZE-1)) + 1;
+    uint32_t pc = start;
+    while(true)
+    {
+        DecodedInsn d;
+        isa->decode(code_word(mem_map, pc), d);
+        b->insns.push_back(d);
+        b->len++;
+
+        if(op_ends_block(d.op))
+        {
+            switch(d.op)
+            {
+                case OP_JAL:
+                    b->exit_pc[0] = pc + d.imm;
+                    if(is_link_reg(d.rd))
+                        b->exit_flags = TBLOCK_CALL;
+                    break;
+                case OP_JALR:
+                    b->exit_flags = TBLOCK_INDIRECT;
+                    if(is_link_reg(d.rd))
+                        b->exit_flags |= TBLOCK_CALL;
+                    else if(d.rd == RV_REG_SINK && is_link_reg(d.rs1) && d.imm == 0)
+                        b->exit_flags |= TBLOCK_RETURN;
+                    break;
+                case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+                    b->exit_pc[0] = pc + d.imm;
+                    b->exit_pc[1] = pc + 4;
+                    break;
+                default:
+                    break;
+            }
+            break;
+        }
+
+        pc += 4;
+        if(b->len == BlockCache::MAX_BLOCK_LEN || pc == page_end || !mem_map->translate(pc, 4, MEM_PERM_X))
+        {
+            b->exit_pc[1] = pc;
+            break;
+        }
+    }
+
+    // Fuse common instruction pairs; records stay one per guest instruction
+    for(uint32_t i=0; i+1<b->len; i++)
+    {
+        if(fuse(b->insns[i], b->insns[i+1]))
+        {
+            // far calls have a static target, so they can be chained
+            if(b->insns[i].op == OP_FUSE_AUIPC_JALR)
+            {
+                b->exit_pc[0] = (start + 4*i + b->insns[i].imm + b->insns[i+1].imm) & ~1u;
+                b->exit_flags = is_link_reg(b->insns[i+1].rd) ? TBLOCK_CALL : 0;
+            }
+            i++;
+        }
+    }
+
+    DecodedInsn end;
+    end.op = OP_BLOCK_END;
+    end.exec = op_handler(OP_BLOCK_END);
+    end.rd = end.rs1 = end.rs2 = 0;
+    end.imm = 0;
+    b->insns.push_back(end);
+
+    return b;
+}
+
+
+template<uint32_t EXT>
+void RVCore::_exec_block(const TBlock * b)
+{
+    const DecodedInsn * d = b->insns.data();
+
+    #ifdef RVSIM_COMPUTED_GOTO
+    static void * const dispatch_table[OP_COUNT] =
+    {
+        // operations outside the extension set are never reached
+        #define RV_OP_LABEL(name) op_enabled(EXT, OP_##name) ? &&L_##name : &&L_ILLEGAL,
+        RV_OP_LIST(RV_OP_LABEL)
+        #undef RV_OP_LABEL
+    };
+
+    goto *dispatch_table[d->op];
+
+    #define RV_OP_HANDLER(name)                                                             \
+        L_##name:                                                                           \
+            if(OP_##name == OP_BLOCK_END)                                                   \
+                return;                                                                     \
+            RVExec::name(*this, *d);                                                        \
+            if(op_may_trap(OP_##name) && UNLIKELY(trapped))                                 \
+                return;                                                                     \
+            d += op_records(OP_##name);                                                     \
+            goto *dispatch_table[d->op];
+    RV_OP_LIST(RV_OP_HANDLER)
+    #undef RV_OP_HANDLER
+
+    #else
+    for(; d->op != OP_BLOCK_END; d += op_records(d->op))
+    {
+        switch(d->op)
+        {
+            #define RV_OP_HANDLER(name)                                                     \
+                case OP_##name:                                                             \
+                    if constexpr(op_enabled(EXT, OP_##name))                                \
+                        RVExec::name(*this, *d);                                            \
+                    else                                                                    \
+                        RVExec::ILLEGAL(*this, *d);                                         \
+                    break;
+            RV_OP_LIST(RV_OP_HANDLER)
+            #undef RV_OP_HANDLER
+        }
+        if(op_may_trap(d->op) && UNLIKELY(trapped))
+            return;
+    }
+    #endif
+}
+
+#define RV_ISA_INSTANTIATE(name, ext) template void RVCore::_exec_block<ext>(const TBlock * b);
+RV_ISA_VARIANTS(RV_ISA_INSTANTIATE)
+#undef RV_ISA_INSTANTIATE
+
+
+bool RVCore::_jit_compile(TBlock * b)
+{
+    if(!jit_buf)
+    {
+        jit_buf.reset(new CodeBuffer());
+        if(!jit_buf->valid())
+        {
+            jit_enabled = false;
+            return false;
+        }
+    }
+
+    b->native = RVJit::compile(this, b, *jit_buf);
+    if(!b->native)
+    {
+        // code buffer full: start over once the current block is left
+        tcache.flush_pending = true;
+        return false;
+    }
+    return true;
+}
+
+
+bool BlockCache::sync(MemMap & mem_map)
+{
+    bool dropped = false;
+    for(std::unordered_map<uint32_t, PageBlocks>::iterator it = pages.begin(); it != pages.end(); )
+    {
+        if(it->second.gen == mem_map.page_gen(it->first << DecodeCache::PAGE_BITS))
+        {
+            it++;
+            continue;
+        }
+
+        for(size_t i=0; i<it->second.pcs.size(); i++)
+        {
+            blocks.erase(it->second.pcs[i]);
+        }
+        it = pages.erase(it);
+        dropped = true;
+    }
+
+    if(dropped)
+    {
+        // surviving blocks may be linked to dropped ones; links are found
+        // again through the hash table
+        for(std::unordered_map<uint32_t, std::unique_ptr<TBlock>>::iterator it = blocks.begin(); it != blocks.end(); it++)
+        {
+            it->second->link[0] = it->second->link[1] = nullptr;
+            it->second->ret_link = nullptr;
+        }
+        _clear_targets();
+    }
+    return dropped;
+}
+
+
+void RVCore::_flush_translations()
+{
+    tcache.flush();
+    ras.clear();
+    if(jit_buf)
+    {
+        jit_buf->reset();
+    }
+}
+
+
+void RVCore::_interp_block()
+{
+    // Execute one guest block (same boundaries as _translate) through the
+    // plain fetch/decode/execute stages
+    uint32_t start = pc;
+    uint32_t len = 0;
+    while(true)
+    {
+        _fetch();
+        _decode();
+        if(!cur)
+            break;  // halted or fetch fault
+        uint8_t op = cur->op;
+        _execute();
+        len++;
+
+        if(halted || op_ends_block(op) || len == BlockCache::MAX_BLOCK_LEN || pc != start + 4*len || (pc & (DecodeCache::PAGE_SIZE-1)) == 0)
+            break;
+    }
+}
+
+
+void RVCore::run_blocks()
+{
+    TBlock * b = nullptr;
+    while(!halted)
+    {
+        if(UNLIKELY(tcache.flush_pending))
+        {
+            _flush_translations();
+        }
+        if(UNLIKELY(code_stale))
+        {
+            // drop blocks of code pages written to since translation
+            code_stale = false;
+            if(tcache.sync(*mem_map))
+                ras.clear();
+        }
+
+        if(!b)
+        {
+            b = tcache.lookup(pc);
+            if(!b)
+            {
+                // Cold code is interpreted until it has run often enough;
+                // so is code that cannot be fetched (the fetch traps)
+                if(!tiers.promote_interp(pc) || UNLIKELY((pc & 0x3) || !mem_map->translate(pc, 4, MEM_PERM_X)))
+                {
+                    _interp_block();
+                    continue;
+                }
+                b = _translate(pc);
+            }
+        }
+
+        // not enough budget left for a whole block: single step the rest
+        if(UNLIKELY(instret + traps + b->len > cli_args->maxitr))
+        {
+            while(!halted && instret + traps < cli_args->maxitr)
+            {
+                tick();
+            }
+            halted = true;
+            break;
+        }
+
+        if(b->native)
+        {
+            pc = b->native(reg_file.data(), this);
+        }
+        else if(jit_enabled && tiers.promote_threaded(b) && _jit_compile(b))
+        {
+            pc = b->native(reg_file.data(), this);
+        }
+        else
+        {
+            (this->*isa->exec_block)(b);
+        }
+
+        if(UNLIKELY(trapped))
+        {
+            // the block was left at the trapping instruction (mepc), which
+            // does not retire; continue at the trap handler
+            trapped = false;
+            instret += (mepc - b->pc) >> 2;
+            if(instret + traps >= cli_args->maxitr)
+                halted = true;
+            b = nullptr;
+            continue;
+        }
+        instret += b->len;
+
+        if(UNLIKELY(halted || tcache.flush_pending || code_stale))
+        {
+            b = nullptr;
+            continue;
+        }
+
+        // calls leave their return address (the block always ends at the call)
+        if(b->exit_flags & TBLOCK_CALL)
+        {
+            ras.push(b->pc + 4*b->len, &b->ret_link);
+        }
+
+        // Follow block links; hash lookup only on the first transition. Links
+        // stay empty while the successor is still interpreted.
+        if(pc == b->exit_pc[0])
+        {
+            if(!b->link[0])
+                b->link[0] = tcache.lookup(pc);
+            b = b->link[0];
+        }
+        else if(pc == b->exit_pc[1])
+        {
+            if(!b->link[1])
+                b->link[1] = tcache.lookup(pc);
+            b = b->link[1];
+        }
+        else if(b->exit_flags & TBLOCK_RETURN)
+        {
+            // returns chain through the caller's ret_link when predicted
+            ReturnStack::Entry e = ras.pop();
+            if(e.pc == pc)
+            {
+                if(!*e.link)
+                    *e.link = tcache.lookup_indirect(pc);
+                b = *e.link;
+            }
+            else
+            {
+                b = tcache.lookup_indirect(pc);
+            }
+        }
+        else if(b->exit_flags & TBLOCK_INDIRECT)
+        {
+            b = tcache.lookup_indirect(pc);
+        }
+        else
+        {
+            b = nullptr;
+        }
+    }
+
+    if(instret + traps >= cli_args->maxitr)
+    {
+        halted = true;
+    }
+}
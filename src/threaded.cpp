@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <string>
+
+#include "defs.h"
+#include "util.h"
+#include "core.h"
+#include "rvexec.h"
+
+extern SimArgs * cli_args;
+
+template<uint32_t EXT>
+void RVCore::_run_threaded()
+{
+    if(halted)
+        return;
+
+    if(instret + traps >= cli_args->maxitr)
+    {
+        halted = true;
+        return;
+    }
+    uint64_t budget = cli_args->maxitr - instret - traps;
+    uint64_t executed = 0;
+    DecodedInsn * d;
+
+    // Locate decode slot of the next instruction
+    // (a misaligned pc comes from the reset address or entry point, jumps to
+    // misaligned targets trap before they get here)
+    #define THREADED_FETCH()                                                                \
+        if(UNLIKELY(pc & 0x3))                                                              \
+        {                                                                                   \
+            _trap(RV_EXC_INSN_MISALIGNED, pc);                                              \
+            trapped = false;                                                                \
+            if(executed >= --budget)                                                        \
+                goto done;                                                                  \
+        }                                                                                   \
+        d = dcache.lookup(pc);
+
+    // Retire current instruction & stop if hart halted or ran out of budget;
+    // instructions that trapped do not retire but use up budget (only checked
+    // where possible)
+    #define THREADED_RETIRE(op)                                                             \
+        if(op_may_trap(op) && UNLIKELY(trapped))                                            \
+        {                                                                                   \
+            trapped = false;                                                                \
+            executed--;                                                                     \
+            budget--;                                                                       \
+        }                                                                                   \
+        if(UNLIKELY(++executed == budget || halted))                                        \
+            goto done;
+
+    #ifdef RVSIM_COMPUTED_GOTO
+    static void * const dispatch_table[OP_COUNT] =
+    {
+        // operations outside the extension set are never reached
+        #define RV_OP_LABEL(name) op_enabled(EXT, OP_##name) ? &&L_##name : &&L_ILLEGAL,
+        RV_OP_LIST(RV_OP_LABEL)
+        #undef RV_OP_LABEL
+    };
+
+    #define DISPATCH() goto *dispatch_table[d->op]
+
+    THREADED_FETCH();
+    DISPATCH();
+
+    // Every handler ends in its own copy of the dispatch code
+    #define RV_OP_HANDLER(name)                                                             \
+        L_##name:                                                                           \
+            RVExec::name(*this, *d);                                                        \
+            THREADED_RETIRE(OP_##name);                                                     \
+            THREADED_FETCH();                                                               \
+            DISPATCH();
+    RV_OP_LIST(RV_OP_HANDLER)
+    #undef RV_OP_HANDLER
+    #undef DISPATCH
+
+    #else
+    while(true)
+    {
+        THREADED_FETCH();
+        switch(d->op)
+        {
+            #define RV_OP_HANDLER(name)                                                     \
+                case OP_##name:                                                             \
+                    if constexpr(op_enabled(EXT, OP_##name))                                \
+                        RVExec::name(*this, *d);                                            \
+                    else                                                                    \
+                        RVExec::ILLEGAL(*this, *d);                                         \
+                    break;
+            RV_OP_LIST(RV_OP_HANDLER)
+            #undef RV_OP_HANDLER
+        }
+        THREADED_RETIRE(d->op);
+    }
+    #endif
+
+    #undef THREADED_FETCH
+    #undef THREADED_RETIRE
+
+    done:
+    instret += executed;
+    if(instret + traps >= cli_args->maxitr)
+    {
+        halted = true;
+    }
+}
+
+#define RV_ISA_INSTANTIATE(name, ext) template void RVCore::_run_threaded<ext>();
+RV_ISA_VARIANTS(RV_ISA_INSTANTIATE)
+#undef RV_ISA_INSTANTIATE
@@ -36,38 +36,6 @@ void throwSuccessMessage(std::string msg, bool exit)
 }
 
 // =============================== FILE READER =====================================
-/**
- * @brief reads a binary file
- * 
- * @param memfile filepath
- * @return std::vector<char> contents
- */
-std::vector<char> fReadBin(std::string memfile)
-{        
-    std::vector<char> fcontents;
-    std::ifstream f (memfile, std::ios::out | std::ios::binary);
-    
-    if(!f)
-    {
-        throw "file access failed";
-    }
-    try
-    {
-        while(!f.eof())
-        {    
-            char byte;
-            f.read((char *) &byte, 1);
-            fcontents.push_back(byte);
-        }
-    }
-    catch(...)
-    {
-        throw "file reading failed!";
-    }
-    f.close();
-    return fcontents;
-}
-
 /**
  * @brief Reads a file and returns its contents
  * 
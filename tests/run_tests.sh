@@ -0,0 +1,57 @@
+#!/bin/sh
+# Regression tests: run every test program on every engine (with and without
+# pretranslation) and compare its signature (see --signature) with the
+# reference in <test>.ref
+#
+# usage: tests/run_tests.sh [rvsim binary]
+#
+# The .elf images are checked in so no RISC-V toolchain is needed; after
+# editing a .S file rebuild its image with
+#   llvm-mc -triple=riscv32 -mattr=+a -filetype=obj <test>.S -o <test>.o
+#   ld.lld -m elf32lriscv -T link.ld <test>.o -o <test>.elf
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+RVSIM=${1:-$TESTS_DIR/../build/bin/rvsim}
+ENGINES="interp threaded block jit tiered"
+
+# test  config  isa  maxitr (per hart)
+TESTS="
+traps       rvsim_test.json     rv32ima 1000000
+trap_vec0   rvsim_test.json     rv32i   100000
+lrsc        rvsim_test_mt.json  rv32ima 10000000
+"
+
+sig=$(mktemp)
+trap 'rm -f "$sig"' EXIT
+
+passed=0
+failed=0
+while read -r test config isa maxitr
+do
+    [ -z "$test" ] && continue
+    for engine in $ENGINES
+    do
+        for pre in "" "--pretranslate"
+        do
+            name="$test [$engine${pre:+ $pre}]"
+            rm -f "$sig"
+            if ! "$RVSIM" -c "$TESTS_DIR/$config" --isa "$isa" --engine "$engine" $pre --maxitr "$maxitr" \
+                --signature "$sig" "$TESTS_DIR/$test.elf" > /dev/null
+            then
+                echo "FAIL $name: rvsim exited with an error"
+                failed=$((failed+1))
+            elif ! diff -u "$TESTS_DIR/$test.ref" "$sig"
+            then
+                echo "FAIL $name: signature differs"
+                failed=$((failed+1))
+            else
+                passed=$((passed+1))
+            fi
+        done
+    done
+done <<EOF
+$TESTS
+EOF
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]